@@ -0,0 +1,55 @@
+/*
+ * Per-call cost of the instrumentation: times pairs of EAUDIT_push and
+ * EAUDIT_pop around an empty function, on any number of threads.
+ *
+ * Usage: bench [calls per thread] [threads]
+ *
+ * bench-slow is the same against a runtime that reads the real time clock on
+ * every push and pop, as it did before the TSC deadline check. Build both
+ * with NOTHROTTLE=y to compare them, or the empty function is soon throttled
+ * by both.
+ */
+#include "eaudit.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace{
+const long kDefaultCalls = 10000000;
+}
+
+void calls(long count){
+  for(long i = 0; i < count; ++i){
+    EAUDIT_push();
+    EAUDIT_pop("empty");
+  }
+}
+
+int main(int argc, char* argv[]){
+  long count = argc > 1 ? atol(argv[1]) : kDefaultCalls;
+  int nthreads = argc > 2 ? atoi(argv[2]) : 1;
+
+  // warm up: set up PAPI and this thread's state
+  calls(1000);
+
+  auto start = chrono::steady_clock::now();
+  vector<thread> threads;
+  for(int i = 0; i < nthreads; ++i){
+    threads.emplace_back(calls, count);
+  }
+  for(auto& t : threads){
+    t.join();
+  }
+  auto elapsed = chrono::duration_cast<chrono::nanoseconds>(
+    chrono::steady_clock::now() - start).count();
+
+  cout << "push+pop:\t" << elapsed / (double) count << " ns per call, "
+       << nthreads << " thread(s)" << endl;
+  EAUDIT_shutdown();
+  return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Front end for programs built without byfl: the hooks GCC and Clang call on
+ * every function entry and exit when compiling with -finstrument-functions,
+ * or, when built with -DEAUDIT_XRAY, the handler of Clang's XRay. Link
+ * libeaudit-instrument.a into the program; the results are written to
+ * eaudit.tsv when it exits.
+ */
+#include "eaudit.h"
+
+#include <atomic>
+#include <cstdint>
+
+#ifdef EAUDIT_XRAY
+#include <xray/xray_interface.h>
+#endif
+
+namespace{
+// hooks still run for the destructors that come after ours
+std::atomic<bool> finished{false};
+// Set while the runtime handles a hook. The linker may keep the program's
+// instrumented copy of a template the runtime uses too, such as
+// std::vector<int>::push_back, whose hooks must not reenter it.
+__thread bool in_hook = false;
+}
+
+extern "C" {
+
+NO_INSTRUMENT void __cyg_profile_func_enter(void* func, void*){
+  if(!in_hook && !finished.load(std::memory_order_relaxed)){
+    in_hook = true;
+    EAUDIT_push_address(func);
+    in_hook = false;
+  }
+}
+
+NO_INSTRUMENT void __cyg_profile_func_exit(void* func, void*){
+  if(!in_hook && !finished.load(std::memory_order_relaxed)){
+    in_hook = true;
+    EAUDIT_pop_address(func);
+    in_hook = false;
+  }
+}
+
+}
+
+#ifdef EAUDIT_XRAY
+NO_INSTRUMENT void xray_handler(int32_t func_id, XRayEntryType type){
+  if(in_hook || finished.load(std::memory_order_relaxed)){
+    return;
+  }
+  in_hook = true;
+  auto func = (void*) __xray_function_address(func_id);
+  if(type == ENTRY){
+    EAUDIT_push_address(func);
+  } else if(type == EXIT || type == TAIL){
+    EAUDIT_pop_address(func);
+  }
+  in_hook = false;
+}
+
+NO_INSTRUMENT __attribute__((constructor)) void start_xray(){
+  __xray_set_handler(xray_handler);
+  __xray_patch();
+}
+#endif
+
+NO_INSTRUMENT __attribute__((destructor)) void stop_instrument(){
+  finished = true;
+#ifdef EAUDIT_XRAY
+  __xray_unpatch();
+  __xray_remove_handler();
+#endif
+  EAUDIT_shutdown();
+}
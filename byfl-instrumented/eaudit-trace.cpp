@@ -0,0 +1,132 @@
+/*
+ * Turn the event logs of a run built with EAUDIT_EVENT_LOG into a timeline
+ * in the Chrome trace event format, which chrome://tracing and Perfetto
+ * open: a slice per call, with what the function spent itself as its
+ * arguments when it was measured.
+ *
+ * Usage: eaudit-trace eaudit.*.events > trace.json
+ */
+#include "event-log.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct event_log_t{
+  events::header_t header;
+  vector<events::record_t> records; // and the measurements among them
+  map<uint32_t, string> names;      // by node
+};
+
+bool read_log(const char* path, event_log_t& log){
+  ifstream file(path, ios::binary);
+  string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+  if(data.size() < sizeof(log.header)){
+    return false;
+  }
+  memcpy(&log.header, data.data(), sizeof(log.header));
+  if(log.header.magic != events::kMagic || log.header.version != events::kVersion){
+    return false;
+  }
+  if(log.header.names_offset > data.size() ||
+     log.header.names_offset < events::kRecordsOffset +
+       log.header.records * sizeof(events::record_t)){
+    // the run did not get to shut down
+    return false;
+  }
+  log.records.resize(log.header.records);
+  memcpy(log.records.data(), data.data() + events::kRecordsOffset,
+         log.records.size() * sizeof(events::record_t));
+  stringstream names(data.substr(log.header.names_offset));
+  uint32_t node;
+  string name;
+  while(names >> node && names.get() == '\t' && getline(names, name)){
+    log.names[node] = name;
+  }
+  return true;
+}
+
+string json_string(const string& s){
+  string escaped = "\"";
+  for(auto c : s){
+    if(c == '"' || c == '\\'){
+      escaped += '\\';
+      escaped += c;
+    } else if((unsigned char) c < 0x20){
+      char code[8];
+      snprintf(code, sizeof(code), "\\u%04x", c);
+      escaped += code;
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped + "\"";
+}
+
+int main(int argc, char* argv[]){
+  if(argc < 2){
+    cerr << "Usage: " << argv[0] << " <event log>... > trace.json" << endl;
+    return -1;
+  }
+  vector<event_log_t> logs;
+  for(int i = 1; i < argc; ++i){
+    logs.emplace_back();
+    if(!read_log(argv[i], logs.back())){
+      cerr << "Skipping " << argv[i] << ": not a complete event log" << endl;
+      logs.pop_back();
+    }
+  }
+
+  // the timeline starts with the first call of any thread
+  auto first_tsc = numeric_limits<uint64_t>::max();
+  for(const auto& log : logs){
+    for(size_t i = 0; i < log.records.size(); ++i){
+      first_tsc = min(first_tsc, log.records[i].start);
+      if(log.records[i].flags & events::kMeasured){
+        i += events::kMeasurementRecords;
+      }
+    }
+  }
+
+  cout << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  const char* separator = "\n";
+  for(const auto& log : logs){
+    const auto& header = log.header;
+    cout << separator << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":"
+         << header.pid << ",\"tid\":" << header.tid
+         << ",\"args\":{\"name\":\"thread " << header.tid << "\"}}";
+    separator = ",\n";
+    auto tsc_per_usec = header.tsc_per_nsec * 1000;
+    for(size_t i = 0; i < log.records.size(); ++i){
+      const auto& record = log.records[i];
+      auto name_iter = log.names.find(record.node);
+      cout << separator << "{\"name\":"
+           << json_string(name_iter != log.names.end() ? name_iter->second : "??")
+           << ",\"ph\":\"X\",\"pid\":" << header.pid << ",\"tid\":" << header.tid
+           << ",\"ts\":" << (record.start - first_tsc) / tsc_per_usec
+           << ",\"dur\":" << (record.end - record.start) / tsc_per_usec;
+      if(record.flags & events::kMeasured &&
+         i + events::kMeasurementRecords < log.records.size()){
+        events::measurement_t measurement;
+        memcpy(&measurement, &log.records[i + 1], sizeof(measurement));
+        i += events::kMeasurementRecords;
+        cout << ",\"args\":{\"Time(s)\":" << measurement.time * 1e-9;
+        for(unsigned j = 0; j < events::kCounters; ++j){
+          cout << "," << json_string(header.counter_names[j]) << ":"
+               << measurement.counters[j];
+        }
+        cout << "}";
+      }
+      cout << "}";
+    }
+  }
+  cout << "\n]}" << endl;
+  return 0;
+}
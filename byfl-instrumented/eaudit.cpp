@@ -2,20 +2,39 @@
 
 #include <iomanip>
 #include <algorithm>
+#include <atomic>
 #include <map>
-#include <stack>
+#include <mutex>
 #include <limits>
 #include <vector>
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <sys/time.h>
+#include <sys/syscall.h>
 #include <signal.h>
+#include <time.h>
+#include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <x86intrin.h>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 
 #include "papi.h"
+#include "streaming-stats.hpp"
+#ifdef EAUDIT_EVENT_LOG
+#include "event-log.hpp"
+#endif
+#ifdef EAUDIT_NO_BYFL
+#include <cxxabi.h>
+#else
 #include <byfl-common.h>
+#endif
 
 #ifdef DEBUG
 #define print(...) printf(__VA_ARGS__)
@@ -23,6 +42,11 @@
 #define print(...)
 #endif
 
+// not defined by older C libraries
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 using namespace std;
 
 namespace{
@@ -32,6 +56,9 @@ const double kNanoToBase = 1e-9;
 const int kOverflowThreshold = 10000000;
 const long long kOneMS = 1000000;
 const long long kCounterMax = numeric_limits<unsigned int>::max();
+// The soonest a counter is assumed to wrap around after; reads further apart
+// may have missed a wrap
+const long long kCounterWrapNsecs = 2 * kSleepSecs * 1000 * kOneMS;
 const char* kCounterNames[] = {
   (char*) "rapl:::PACKAGE_ENERGY:PACKAGE0",
   (char*) "rapl:::PP0_ENERGY:PACKAGE0",
@@ -39,6 +66,36 @@ const char* kCounterNames[] = {
   (char*) "PAPI_TOT_CYC"
 };
 constexpr int kNumCounters = sizeof(kCounterNames) / sizeof(kCounterNames[0]);
+// Shadow stack depth every thread starts out with room for
+const size_t kStackReserve = 256;
+// Initial number of slots in a thread's calling-context tree, a power of two
+const size_t kNodeSlots = 1024;
+// The counter the call graph reports as energy
+const int kEnergyCounter = 0;
+// The counters that measure the whole package rather than the thread
+const char* kPackagePrefix = "rapl:::";
+// The counter the package's counts are handed out to the threads by
+const int kCycleCounter = 3;
+// How long to compare the TSC to the real time clock for
+const long long kCalibrationNsecs = 5 * kOneMS;
+// How long to time pushes and pops of an empty function for, long enough for
+// the RAPL counters to tick many times
+const long long kProbeCalibrationNsecs = 50 * kOneMS;
+const char* kProbeCalibrationName = "(probe calibration)";
+#ifndef EAUDIT_NO_THROTTLE
+// Calls of a calling context after which to check whether it is worth
+// measuring, a power of two
+const unsigned long long kThrottleWindow = 1 << 14;
+// Contexts called less often than this are always measured
+const double kThrottleCallsPerSec = 100000;
+#endif
+// Most addresses to resolve with one addr2line call
+const size_t kAddressesPerCall = 512;
+#ifdef EAUDIT_RECORD_ALL
+// Reported for every function
+const double kQuantiles[] = {0.5, 0.95, 0.99};
+const char* kQuantileNames[] = {"p50", "p95", "p99"};
+#endif
 }
 
 struct stats_t {
@@ -46,7 +103,7 @@ struct stats_t {
   long long counters[kNumCounters];
 };
 
-inline stats_t operator+(stats_t lhs, const stats_t& rhs) {
+NO_INSTRUMENT inline stats_t operator+(stats_t lhs, const stats_t& rhs) {
   stats_t sum;
   sum.time = lhs.time + rhs.time;
   for (int i = 0; i < kNumCounters; ++i) {
@@ -55,44 +112,471 @@ inline stats_t operator+(stats_t lhs, const stats_t& rhs) {
   return sum;
 }
 
-stats_t& last_stats(){
-  static stats_t last_stats_;
-  return last_stats_;
-}
+#ifdef EAUDIT_RECORD_ALL
+/*
+ * What the calls of a function spent, in constant space however many calls
+ * there are: the totals, and how the time and every counter are distributed
+ * over the calls.
+ */
+struct function_stats_t{
+  stats_t total{};
+  stream::Moments moments[kNumCounters + 1]; // time, then the counters
+  stream::QuantileSketch quantiles[kNumCounters + 1];
 
-stack<stats_t, vector<stats_t> >& cur_stats(){
-  static stack<stats_t, vector<stats_t> > cur_stats_;
-  return cur_stats_;
-}
+  NO_INSTRUMENT void add(const stats_t& call){
+    total = total + call;
+    moments[0].add(call.time);
+    quantiles[0].add(call.time);
+    for(int i = 0; i < kNumCounters; ++i){
+      moments[i + 1].add(call.counters[i]);
+      quantiles[i + 1].add(call.counters[i]);
+    }
+  }
+
+  NO_INSTRUMENT void merge(const function_stats_t& other){
+    total = total + other.total;
+    for(int i = 0; i <= kNumCounters; ++i){
+      moments[i].merge(other.moments[i]);
+      quantiles[i].merge(other.quantiles[i]);
+    }
+  }
+};
+#else
+typedef stats_t function_stats_t;
+#endif
+// by function name, merged over all threads at shutdown
+typedef map<string, function_stats_t> total_stats_t;
 
 #ifdef EAUDIT_RECORD_ALL
-map<string, vector<stats_t> >& total_stats(){
-  static map<string, vector<stats_t> >* total_stats_ = new map<string, vector<stats_t> >();
-  return *total_stats_;
+NO_INSTRUMENT inline const stats_t& sum(const function_stats_t& stats){
+  return stats.total;
+}
+#else
+NO_INSTRUMENT inline const stats_t& sum(const function_stats_t& total){
+  return total;
 }
+#endif
+
+/*
+ * One calling context: a chain of instrumented calls from the start of the
+ * thread.
+ */
+struct cct_node_t{
+  unsigned parent;
+  const void* site;      // that the node is found by
+  unsigned first_child;  // 0 if none, the others follow by next_sibling
+  unsigned next_sibling;
+  // What the function was popped with: byfl passes the same string literal
+  // for every pop of a function, and the other front ends the address of the
+  // function. Looked at only at shutdown. nullptr until the first pop.
+  const void* func;
+  unsigned long long calls;
+  function_stats_t exclusive; // inclusive is added up at shutdown
+  stats_t correction;         // probe overhead taken out of what was read
+  // Counted, but left in their parent, once the context turned out to be
+  // called too often for too short to measure. Not in calls.
+  unsigned long long throttled_calls;
+  bool throttled;
+  unsigned long long window_start; // TSC, at the start of the last window
+  unsigned long long window_ticks; // spent in the calls of the window
+  // A site that turned out to push more than one function, whose node only
+  // holds what the callees of the call under way spend, see split_site()
+  bool shared;
+};
+
+/*
+ * A thread's calling-context tree. A node is found by the ID of its parent
+ * and the site that pushed it, which the function is only known by until it
+ * pops, in an open addressing table. Node 0 is the thread itself.
+ */
+class CallTree{
+ public:
+  NO_INSTRUMENT CallTree() : slots_(kNodeSlots), nodes_(1) {}
+
+  NO_INSTRUMENT unsigned child(unsigned parent, const void* site){
+    auto mask = slots_.size() - 1;
+    for(auto i = hash(parent, site) & mask;; i = (i + 1) & mask){
+      auto& slot = slots_[i];
+      if(slot.site == site && slot.parent == parent){
+        return slot.id;
+      }
+      if(slot.site == nullptr){
+        slot.site = site;
+        slot.parent = parent;
+        slot.id = nodes_.size();
+        nodes_.emplace_back();
+        nodes_.back().parent = parent;
+        nodes_.back().site = site;
+        nodes_.back().next_sibling = nodes_[parent].first_child;
+        nodes_[parent].first_child = slot.id;
+        // keep at most half of the slots in use, so that probes stay short
+        if(nodes_.size() * 2 > slots_.size()){
+          grow();
+        }
+        return nodes_.size() - 1;
+      }
+    }
+  }
+
+  /*
+   * Add what a node and its descendants recorded to another node and its
+   * descendants, matched by site, and clear it, keeping the nodes for the
+   * calls to come. Descendants that were not called are left alone.
+   */
+  NO_INSTRUMENT void move(unsigned from, unsigned to){
+    if(nodes_[from].func != nullptr){
+      nodes_[to].func = nodes_[from].func;
+    }
+    nodes_[to].calls += nodes_[from].calls;
+    nodes_[to].throttled_calls += nodes_[from].throttled_calls;
+#ifdef EAUDIT_RECORD_ALL
+    nodes_[to].exclusive.merge(nodes_[from].exclusive);
 #else
-map<string, stats_t>& total_stats(){
-  static map<string, stats_t>* total_stats_ = new map<string, stats_t>();
-  return *total_stats_;
+    nodes_[to].exclusive = nodes_[to].exclusive + nodes_[from].exclusive;
+#endif
+    nodes_[to].correction = nodes_[to].correction + nodes_[from].correction;
+    nodes_[from].calls = 0;
+    nodes_[from].throttled_calls = 0;
+    nodes_[from].exclusive = function_stats_t();
+    nodes_[from].correction = stats_t();
+    for(auto id = nodes_[from].first_child; id != 0; id = nodes_[id].next_sibling){
+      if(nodes_[id].calls + nodes_[id].throttled_calls > 0){
+        // child() may move the nodes
+        auto to_child = child(to, nodes_[id].site);
+        move(id, to_child);
+      }
+    }
+  }
+
+  // by ID, parents before their children
+  NO_INSTRUMENT vector<cct_node_t>& nodes() { return nodes_; }
+  NO_INSTRUMENT const vector<cct_node_t>& nodes() const { return nodes_; }
+
+ private:
+  struct slot_t{
+    const void* site;
+    unsigned parent;
+    unsigned id;
+  };
+
+  NO_INSTRUMENT static size_t hash(unsigned parent, const void* site){
+    // Fibonacci hashing of the address, whose lowest bits vary little
+    return (((uintptr_t)site >> 3) ^ ((uintptr_t)parent << 32)) *
+      0x9E3779B97F4A7C15ull >> 20;
+  }
+
+  NO_INSTRUMENT void grow(){
+    vector<slot_t> slots(slots_.size() * 2);
+    auto mask = slots.size() - 1;
+    for(const auto& slot : slots_){
+      if(slot.site != nullptr){
+        auto i = hash(slot.parent, slot.site) & mask;
+        while(slots[i].site != nullptr){
+          i = (i + 1) & mask;
+        }
+        slots[i] = slot;
+      }
+    }
+    slots_.swap(slots);
+  }
+
+  vector<slot_t> slots_;
+  vector<cct_node_t> nodes_;
+};
+
+/*
+ * An active call of an instrumented function.
+ */
+struct frame_t{
+  stats_t stats; // spent in the function itself so far
+  unsigned node;
+  unsigned first_node;      // created after the push
+  unsigned long long start; // TSC
+};
+
+/*
+ * Whether functions are popped by address rather than by name. Set by the
+ * first EAUDIT_pop_address, so mixing front ends in one program is not
+ * supported.
+ */
+NO_INSTRUMENT atomic<bool>& popped_by_address(){
+  static atomic<bool> popped_by_address_{false};
+  return popped_by_address_;
+}
+
+/*
+ * Everything one thread measures: its own counters, the shadow stack of the
+ * instrumented functions it is in, and the tree of the calls it made.
+ * Only ever touched by its thread until shutdown, so no locking is needed.
+ * Never freed, so that the stats of threads that exit are still around at
+ * shutdown.
+ */
+struct thread_state_t{
+  // TSC value before which the counters are not worth reading, checked first
+  // thing by every push and pop. The thread's timer sets it to 0 to have the
+  // next push or pop read them; a thread that stays in one call is only read
+  // when it returns.
+  volatile unsigned long long read_deadline;
+  stats_t last_stats;        // counter values at the last read
+  vector<frame_t> cur_stats; // shadow stack, one entry per active function
+  CallTree tree;
+  unsigned long long probes; // pushes and pops since the counters were read
+  // Active calls of throttled contexts, and of the functions they called,
+  // none of which have a frame
+  unsigned long long throttled_depth;
+  vector<int> eventsets;     // one per component_events()
+  timer_t timer;             // sends SIGALRM to this thread only
+  atomic<bool> timer_armed;  // until the thread exits or shutdown
+#ifdef EAUDIT_EVENT_LOG
+  events::Writer log;        // a record per call
+  pid_t tid;
+  vector<string> node_names; // node ID -> function, set at shutdown
+#endif
+  thread_state_t* next;      // in the list of all threads' states
+};
+
+/*
+ * The state of the calling thread, null until its first push. Only read by
+ * the signal handler, which must not allocate it.
+ */
+static __thread thread_state_t* current_thread_state = nullptr;
+
+/*
+ * Head of the list of all threads' states, for shutdown to merge.
+ */
+NO_INSTRUMENT atomic<thread_state_t*>& thread_states(){
+  static atomic<thread_state_t*> thread_states_{nullptr};
+  return thread_states_;
+}
+
+/*
+ * Have SIGALRM delivered to the thread every kSleepSecs, which makes its next
+ * push or pop read the counters. The handler cannot read them itself, so a
+ * call that lasts longer than kCounterWrapNsecs without calling another may
+ * still see a counter wrap around more than once, which counter_delta() can
+ * only report.
+ */
+NO_INSTRUMENT void start_thread_timer(thread_state_t& state){
+  struct sigevent event;
+  memset(&event, 0, sizeof(event));
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = SIGALRM;
+  event.sigev_notify_thread_id = syscall(SYS_gettid);
+  if(timer_create(CLOCK_MONOTONIC, &event, &state.timer) == -1){
+    fprintf(stderr, "Unable to create timer: %s\n", strerror(errno));
+    exit(-1);
+  }
+  struct itimerspec work_time;
+  work_time.it_value.tv_sec = kSleepSecs;
+  work_time.it_value.tv_nsec = kSleepUsecs * 1000;
+  work_time.it_interval = work_time.it_value;
+  timer_settime(state.timer, 0, &work_time, nullptr);
+  state.timer_armed = true;
+}
+
+/*
+ * Called by whichever of thread exit and shutdown comes first.
+ */
+NO_INSTRUMENT void stop_thread_timer(thread_state_t& state){
+  if(state.timer_armed.exchange(false)){
+    timer_delete(state.timer);
+  }
+}
+
+NO_INSTRUMENT pthread_key_t& thread_exit_key(){
+  static pthread_key_t thread_exit_key_;
+  return thread_exit_key_;
+}
+
+NO_INSTRUMENT void thread_exit(void* state){
+  stop_thread_timer(*static_cast<thread_state_t*>(state));
+}
+
+/*
+ * TSC ticks per nanosecond, measured once by init_papi(). Assumes an
+ * invariant TSC, which counts at the same rate on all cores.
+ */
+NO_INSTRUMENT double& tsc_per_nsec(){
+  static double tsc_per_nsec_ = 0;
+  return tsc_per_nsec_;
+}
+
+/*
+ * What a push or a pop costs on this machine, on average, including its share
+ * of the counter reads. Measured once, by calibrate_probes().
+ */
+struct probe_cost_t{
+  double time;
+  double counters[kNumCounters];
+};
+
+NO_INSTRUMENT probe_cost_t& probe_cost(){
+  static probe_cost_t probe_cost_{};
+  return probe_cost_;
+}
+
+NO_INSTRUMENT void calibrate_probes(thread_state_t& state);
+NO_INSTRUMENT void read_counter_values(const thread_state_t& state,
+                                       long long (&values)[kNumCounters]);
+
+NO_INSTRUMENT void calibrate_tsc(){
+  auto start_nsec = PAPI_get_real_nsec();
+  auto start_tsc = __rdtsc();
+  long long nsecs;
+  while((nsecs = PAPI_get_real_nsec() - start_nsec) < kCalibrationNsecs){
+  }
+  tsc_per_nsec() = (__rdtsc() - start_tsc) / (double) nsecs;
+}
+
+#ifdef EAUDIT_EVENT_LOG
+static_assert(kNumCounters == events::kCounters,
+              "event log records have room for another number of counters");
+
+/*
+ * Every thread writes the calls it makes to eaudit.<thread ID>.events,
+ * which eaudit-trace turns into a timeline.
+ */
+NO_INSTRUMENT void open_event_log(thread_state_t& state){
+  state.tid = syscall(SYS_gettid);
+  events::header_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = events::kMagic;
+  header.version = events::kVersion;
+  header.pid = getpid();
+  header.tid = state.tid;
+  header.tsc_per_nsec = tsc_per_nsec();
+  for(int i = 0; i < kNumCounters; ++i){
+    strncpy(header.counter_names[i], kCounterNames[i], events::kNameSize - 1);
+  }
+  stringstream path;
+  path << "eaudit." << state.tid << ".events";
+  state.log.open(path.str(), header);
 }
 #endif
 
-map<int, vector<int> >& component_events(){
-  static map<int, vector<int> > component_events_;
+NO_INSTRUMENT thread_state_t& this_thread_state(){
+  auto& state = current_thread_state;
+  if(state == nullptr){
+    state = new thread_state_t();
+    init_thread(state->eventsets);
+    state->last_stats.time = PAPI_get_real_nsec();
+    read_counter_values(*state, state->last_stats.counters);
+    state->cur_stats.reserve(kStackReserve);
+    // Set a dummy first element, for the root of the tree, so that the first
+    // push has some place to put the previous function energy.
+    state->cur_stats.emplace_back();
+    static once_flag probes_calibrated;
+    call_once(probes_calibrated, calibrate_probes, ref(*state));
+#ifdef EAUDIT_EVENT_LOG
+    open_event_log(*state);
+#endif
+    state->next = thread_states().load();
+    while(!thread_states().compare_exchange_weak(state->next, state)){
+    }
+    start_thread_timer(*state);
+    pthread_setspecific(thread_exit_key(), state);
+  }
+  return *state;
+}
+
+/*
+ * The counters of a PAPI component, which one eventset reads.
+ */
+struct component_t{
+  vector<int> events;
+  vector<int> counters; // where the events are in kCounterNames
+};
+
+/*
+ * The components of the counters that every thread reads for itself, by ID.
+ * Not changed after init_papi().
+ */
+NO_INSTRUMENT map<int, component_t>& component_events(){
+  static map<int, component_t> component_events_;
   return component_events_;
 }
 
-vector<int>& get_eventsets(){
-  static vector<int> eventsets;
-  static int init = 1;
-  if(init == 1){
-    init_papi(eventsets);
-    init = 0;
+/*
+ * The RAPL counters measure the whole package, so a thread that read them
+ * would count the energy of all of the threads that ran in the meantime.
+ * Instead they are read for the whole process, at most every kOneMS, by
+ * whichever thread gets to it first, and handed out to the threads by the
+ * cycles they ran: every read of a thread's counters is charged its cycles
+ * times the energy per cycle of the last interval of the process. Whatever
+ * that charged more or less than was measured is made up for in the next
+ * interval, so the threads add up to what was measured, but for the last
+ * interval. The energy of intervals in which no thread ran goes to the ones
+ * after.
+ */
+struct package_counters_t{
+  map<int, component_t> components;
+  vector<int> eventsets;           // started by the first thread
+  mutex lock;                      // for the rest
+  atomic<long long> last_time;     // of the last read
+  long long last_values[kNumCounters];
+  double owed[kNumCounters];       // measured, but not handed out yet
+  atomic<long long> cycles;        // handed out for, since the last read
+  atomic<double> per_cycle[kNumCounters];
+};
+
+NO_INSTRUMENT package_counters_t& package_counters(){
+  static package_counters_t package_counters_;
+  return package_counters_;
+}
+
+/*
+ * Create and start an eventset for each component, on the calling thread.
+ */
+NO_INSTRUMENT void start_eventsets(const map<int, component_t>& components,
+                                   vector<int>& eventsets){
+  for(const auto& component : components){
+    int eventset = PAPI_NULL;
+    auto events = component.second.events;
+    int retval = PAPI_create_eventset(&eventset);
+    if(retval != PAPI_OK){
+      PAPI_perror(NULL);
+      exit(-1);
+    }
+    retval = PAPI_add_events(eventset, &events[0], events.size());
+    if(retval != PAPI_OK){
+      PAPI_perror(NULL);
+      exit(-1);
+    }
+    retval = PAPI_start(eventset);
+    if(retval != PAPI_OK){
+      PAPI_perror(NULL);
+      exit(-1);
+    }
+    eventsets.push_back(eventset);
+  }
+}
+
+/*
+ * Read the eventsets of the components into where their counters are in
+ * kCounterNames, leaving the other counters alone.
+ */
+NO_INSTRUMENT void read_components(const map<int, component_t>& components,
+                                   const vector<int>& eventsets,
+                                   long long (&values)[kNumCounters]){
+  auto eventset = eventsets.begin();
+  for(const auto& component : components){
+    long long component_values[kNumCounters];
+    int retval = PAPI_read(*eventset++, component_values);
+    if(retval != PAPI_OK){
+      PAPI_perror(NULL);
+      exit(-1);
+    }
+    const auto& counters = component.second.counters;
+    for(unsigned i = 0; i < counters.size(); ++i){
+      values[counters[i]] = component_values[i];
+    }
   }
-  return eventsets;
 }
 
-void init_papi(vector<int>& eventsets){
+/*
+ * Set up PAPI for the whole process, once.
+ */
+NO_INSTRUMENT void init_papi(){
   print("init\n");
   int retval;
   if ( ( retval = PAPI_library_init( PAPI_VER_CURRENT ) ) != PAPI_VER_CURRENT ){
@@ -113,153 +597,941 @@ void init_papi(vector<int>& eventsets){
     }
     exit(-1);
   }
+  // count instructions and cycles per thread
+  if((retval = PAPI_thread_init(pthread_self)) != PAPI_OK){
+    fprintf(stderr, "Unable to init PAPI threads.\n");
+    exit(-1);
+  }
 
-
-  for(auto& event_name : kCounterNames){
+  auto& package = package_counters();
+  for(int i = 0; i < kNumCounters; ++i){
     int event_code;
-    retval = PAPI_event_name_to_code((char*) event_name, &event_code);
+    retval = PAPI_event_name_to_code((char*) kCounterNames[i], &event_code);
     if(retval != PAPI_OK){
       PAPI_perror(NULL);
       exit(-1);
     }
     int component = PAPI_get_event_component(event_code);
-    component_events()[component].push_back(event_code);
+    auto& components = strncmp(kCounterNames[i], kPackagePrefix,
+                               strlen(kPackagePrefix)) == 0 ?
+      package.components : component_events();
+    components[component].events.push_back(event_code);
+    components[component].counters.push_back(i);
   }
+  start_eventsets(package.components, package.eventsets);
+  read_components(package.components, package.eventsets, package.last_values);
+  package.last_time = PAPI_get_real_nsec();
 
-  for(auto& component : component_events()){
-    int eventset = PAPI_NULL;
-    PAPI_create_eventset(&eventset);
-    if(retval != PAPI_OK){
-      PAPI_perror(NULL);
-      exit(-1);
-    }
-    PAPI_add_events(eventset, &component.second[0], component.second.size());
-    if(retval != PAPI_OK){
-      PAPI_perror(NULL);
-      exit(-1);
-    }
-    eventsets.push_back(eventset);
-  }
+  calibrate_tsc();
 
-  for(auto& eventset : eventsets){
-    retval=PAPI_start(eventset);
-    if(retval != PAPI_OK){
-      PAPI_perror(NULL);
-      exit(-1);
-    }
-  }
-
-  // set up signal handler
-  if(signal(SIGALRM, overflow) == SIG_ERR){
+  // set up signal handler, the timers are per thread
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = overflow;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  if(sigaction(SIGALRM, &action, nullptr) == -1){
     fprintf(stderr, "Unable to set up signal handler\n");
     exit(-1);
   }
+  if(pthread_key_create(&thread_exit_key(), thread_exit) != 0){
+    fprintf(stderr, "Unable to set up thread exit handler\n");
+    exit(-1);
+  }
+}
 
-  // Set a dummy first element so that the first do_push has some place to put 
-  // the previous function energy.
-  cur_stats().emplace();
+/*
+ * Start the counters of the calling thread, but the package's.
+ */
+NO_INSTRUMENT void init_thread(vector<int>& eventsets){
+  static once_flag papi_initialized;
+  call_once(papi_initialized, init_papi);
+  start_eventsets(component_events(), eventsets);
+}
 
-  struct itimerval work_time;
-  work_time.it_value.tv_sec = kSleepSecs;
-  work_time.it_value.tv_usec = kSleepUsecs;
-  work_time.it_interval.tv_sec = kSleepSecs;
-  work_time.it_interval.tv_usec = kSleepUsecs;
-  setitimer(ITIMER_REAL, &work_time, nullptr);
+/*
+ * The counters of a thread, with 0 for the package's.
+ */
+NO_INSTRUMENT void read_counter_values(const thread_state_t& state,
+                         long long (&values)[kNumCounters]){
+  for(auto& value : values){
+    value = 0;
+  }
+  read_components(component_events(), state.eventsets, values);
 }
 
-bool read_rapl(){
-  auto eventsets = get_eventsets();
-  long long curtime = PAPI_get_real_nsec();
-  print("timediff: %f\n", (curtime - last_stats().time) * (double) kNanoToBase);
-  if(curtime - last_stats().time > kOneMS){
-    long long cntr_vals[kNumCounters];
-    int cntr_offset = 0;
-    for(int i = 0; i < eventsets.size(); ++i){
-      int retval=PAPI_read(eventsets[i], cntr_vals + cntr_offset);
-      if(retval != PAPI_OK){
-        PAPI_perror(NULL);
-        exit(-1);
+/*
+ * Reads that were too far apart for their counters to be trusted, over all
+ * threads.
+ */
+NO_INSTRUMENT atomic<unsigned long long>& unreliable_reads(){
+  static atomic<unsigned long long> unreliable_reads_{0};
+  return unreliable_reads_;
+}
+
+/*
+ * What a counter counted between two reads elapsed_nsecs apart. A single wrap
+ * around shows in the values, but not any more than that, so the caller is
+ * told if the reads were more than kCounterWrapNsecs apart.
+ */
+NO_INSTRUMENT inline long long counter_delta(long long now, long long before,
+                                             long long elapsed_nsecs,
+                                             bool& unreliable){
+  if(elapsed_nsecs > kCounterWrapNsecs){
+    unreliable = true;
+  }
+  if(now < before){
+    return kCounterMax - before + now;
+  }
+  return now - before;
+}
+
+/*
+ * Read the package's counters, and work out how much to hand out per cycle
+ * until the next read. Called with the lock held.
+ */
+NO_INSTRUMENT void read_package(package_counters_t& package, long long curtime){
+  long long values[kNumCounters];
+  read_components(package.components, package.eventsets, values);
+  auto cycles = package.cycles.exchange(0);
+  auto elapsed = curtime - package.last_time;
+  auto unreliable = false;
+  for(const auto& component : package.components){
+    for(auto i : component.second.counters){
+      auto measured = counter_delta(values[i], package.last_values[i], elapsed,
+                                    unreliable);
+      auto per_cycle = package.per_cycle[i].load(memory_order_relaxed);
+      package.owed[i] += measured - cycles * per_cycle;
+      if(cycles > 0){
+        // as much as was measured, and what is still owed, if the next
+        // interval runs as many cycles
+        package.per_cycle[i] = max(0.0, (measured + package.owed[i]) / cycles);
       }
-      cntr_offset += component_events()[eventsets[i]].size();
+      package.last_values[i] = values[i];
     }
+  }
+  package.last_time = curtime;
+  if(unreliable){
+    ++unreliable_reads();
+  }
+}
 
-    for(int i = 0; i < kNumCounters; ++i){
-      long long total;
-      if(cntr_vals[i] < last_stats().counters[i]){
-        total = kCounterMax - last_stats().counters[i] + cntr_vals[i];
-      } else {
-        total = cntr_vals[i] - last_stats().counters[i];
-      }
-      cur_stats().top().counters[i] += total;
+/*
+ * The share of the package's counters of a thread that ran the given cycles
+ * since it last read its counters, into deltas.
+ */
+NO_INSTRUMENT void package_share(long long cycles, long long curtime,
+                                 long long (&deltas)[kNumCounters]){
+  auto& package = package_counters();
+  package.cycles += cycles;
+  for(const auto& component : package.components){
+    for(auto i : component.second.counters){
+      deltas[i] = (long long)(cycles *
+                              package.per_cycle[i].load(memory_order_relaxed));
+    }
+  }
+  // the others carry on rather than wait for the read
+  if(curtime - package.last_time > kOneMS && package.lock.try_lock()){
+    if(curtime - package.last_time > kOneMS){
+      read_package(package, curtime);
     }
+    package.lock.unlock();
+  }
+}
 
-    cur_stats().top().time += curtime - last_stats().time;
-    stats_t last_stat;
-    last_stat.time = curtime;
-    for(int i = 0; i < kNumCounters; ++i){
-      last_stat.counters[i] = cntr_vals[i];
+/*
+ * The fast path of every push and pop: whether it may be time to read the
+ * counters again.
+ */
+NO_INSTRUMENT inline bool read_due(const thread_state_t& state, unsigned long long now){
+#ifdef EAUDIT_NO_FAST_PATH
+  // every push and pop asks the real time clock, to compare against
+  (void) state;
+  (void) now;
+  return true;
+#else
+  return now >= state.read_deadline;
+#endif
+}
+
+/*
+ * Read the counters of a thread into the function on top of its shadow
+ * stack, if they were last read long enough ago.
+ */
+NO_INSTRUMENT bool read_counters(thread_state_t& state){
+  auto& last_stats = state.last_stats;
+  auto& top = state.cur_stats.back().stats;
+  long long curtime = PAPI_get_real_nsec();
+  print("timediff: %f\n", (curtime - last_stats.time) * (double) kNanoToBase);
+  if(curtime - last_stats.time <= kOneMS){
+    // the TSC ran ahead of the clock
+    state.read_deadline = __rdtsc() +
+      (kOneMS - (curtime - last_stats.time)) * tsc_per_nsec();
+    return false;
+  }
+  long long cntr_vals[kNumCounters];
+  read_counter_values(state, cntr_vals);
+
+  // take out what the probes since the last read cost, as far as it is there.
+  // Kept in the node rather than the frame, which every push has to clear.
+  auto& correction = state.tree.nodes()[state.cur_stats.back().node].correction;
+  const auto& cost = probe_cost();
+  auto probes = state.probes;
+  state.probes = 0;
+  auto elapsed = curtime - last_stats.time;
+  auto unreliable = false;
+  long long deltas[kNumCounters];
+  for(int i = 0; i < kNumCounters; ++i){
+    deltas[i] = counter_delta(cntr_vals[i], last_stats.counters[i], elapsed,
+                              unreliable);
+  }
+  if(unreliable){
+    ++unreliable_reads();
+  }
+  package_share(deltas[kCycleCounter], curtime, deltas);
+  for(int i = 0; i < kNumCounters; ++i){
+    auto total = deltas[i];
+    auto overhead = min(total, (long long)(probes * cost.counters[i]));
+    top.counters[i] += total - overhead;
+    correction.counters[i] += overhead;
+  }
+
+  auto overhead = min(elapsed, (long long)(probes * cost.time));
+  top.time += elapsed - overhead;
+  correction.time += overhead;
+  stats_t last_stat;
+  last_stat.time = curtime;
+  for(int i = 0; i < kNumCounters; ++i){
+    last_stat.counters[i] = cntr_vals[i];
+  }
+  last_stats = last_stat;
+  state.read_deadline = __rdtsc() + kOneMS * tsc_per_nsec();
+  return true;
+}
+
+NO_INSTRUMENT bool read_rapl(){
+  auto& state = this_thread_state();
+  return read_due(state, __rdtsc()) && read_counters(state);
+}
+
+/*
+ * The counters of a thread, with the package's as they are, for the package
+ * to be all the thread's, as it should be while calibrate_probes() runs.
+ */
+NO_INSTRUMENT void read_counter_values_with_package(const thread_state_t& state,
+                                      long long (&values)[kNumCounters]){
+  read_counter_values(state, values);
+  auto& package = package_counters();
+  lock_guard<mutex> guard(package.lock);
+  read_components(package.components, package.eventsets, values);
+}
+
+/*
+ * Time pushes and pops of an empty function on the first thread, with the
+ * counters read as usual, and forget them again. This may be while the
+ * program is still being initialized, before even std::cout is, so it must
+ * not write anything: the cost is reported at shutdown.
+ */
+NO_INSTRUMENT void calibrate_probes(thread_state_t& state){
+  long long start_counters[kNumCounters], end_counters[kNumCounters];
+  read_counter_values_with_package(state, start_counters);
+  auto start_time = PAPI_get_real_nsec();
+  long long calls = 0;
+  long long elapsed;
+  do{
+    for(int i = 0; i < 1000; ++i){
+      EAUDIT_push();
+      EAUDIT_pop(kProbeCalibrationName);
     }
-    last_stats() = last_stat;
-    return true;
+    calls += 1000;
+  } while((elapsed = PAPI_get_real_nsec() - start_time) < kProbeCalibrationNsecs);
+  read_counter_values_with_package(state, end_counters);
+
+  auto& cost = probe_cost();
+  cost.time = elapsed / (2.0 * calls);
+  auto unreliable = false;
+  for(int i = 0; i < kNumCounters; ++i){
+    cost.counters[i] = counter_delta(end_counters[i], start_counters[i],
+                                     elapsed, unreliable) / (2.0 * calls);
+  }
+  state.tree = CallTree();
+  state.cur_stats.assign(1, frame_t());
+  state.probes = 0;
+  auto& package = package_counters();
+  lock_guard<mutex> guard(package.lock);
+  for(auto& owed : package.owed){
+    owed = 0;
+  }
+  package.cycles = 0;
+}
+
+#ifndef EAUDIT_NO_THROTTLE
+/*
+ * At the end of every window of kThrottleWindow calls of a context, stop
+ * measuring it if it was called at least kThrottleCallsPerSec times a second
+ * and its calls took less time on average than the push and pop that measure
+ * them. Only ever pushes it to the near-no-op path, for the rest of the run.
+ */
+NO_INSTRUMENT void consider_throttling(cct_node_t& node, unsigned long long now){
+  auto window_start = node.window_start;
+  auto window_ticks = node.window_ticks;
+  node.window_start = now;
+  node.window_ticks = 0;
+  if(window_start == 0){
+    // the first window starts now
+    return;
+  }
+  auto ticks_per_sec = tsc_per_nsec() / kNanoToBase;
+  auto calls_per_sec = kThrottleWindow * ticks_per_sec / (now - window_start);
+  auto average_nsecs = window_ticks / (double) kThrottleWindow / tsc_per_nsec();
+  // no probe cost, as while it is measured, is never worth throttling for
+  if(calls_per_sec >= kThrottleCallsPerSec &&
+     average_nsecs < 2 * probe_cost().time){
+    print("throttling after %llu calls: %f ns per call\n", node.calls,
+          average_nsecs);
+    node.throttled = true;
+  }
+}
+#endif
+
+NO_INSTRUMENT void push_function(const void* site){
+  auto& state = this_thread_state();
+#ifndef EAUDIT_NO_THROTTLE
+  if(state.throttled_depth > 0){
+    // called by a throttled function, so too short to tell apart
+    ++state.throttled_depth;
+    return;
+  }
+#endif
+  auto node = state.tree.child(state.cur_stats.back().node, site);
+#ifndef EAUDIT_NO_THROTTLE
+  if(state.tree.nodes()[node].throttled){
+    ++state.tree.nodes()[node].throttled_calls;
+    state.throttled_depth = 1;
+    return;
+  }
+#endif
+  ++state.probes;
+  auto now = __rdtsc();
+  if(read_due(state, now)){
+    read_counters(state);
   }
-  return false;
+  state.cur_stats.emplace_back();
+  state.cur_stats.back().node = node;
+  state.cur_stats.back().first_node = state.tree.nodes().size();
+  state.cur_stats.back().start = now;
 }
 
-void EAUDIT_push(){
+/*
+ * Byfl calls it first thing in every function, so where it returns to tells
+ * the functions apart until they pop.
+ */
+NO_INSTRUMENT __attribute__((noinline)) void EAUDIT_push(){
   print("push\n");
-  read_rapl();
-  cur_stats().emplace();
+  push_function(__builtin_return_address(0));
 }
 
-void EAUDIT_pop(const char* func_name){
-  print("popping %s\n", func_name);
-  auto did_read = read_rapl();
+NO_INSTRUMENT void EAUDIT_push_address(void* func_addr){
+  print("push %p\n", func_addr);
+  push_function(func_addr);
+}
+
+/*
+ * Pushes only know the site, so once a site turns out to push more than one
+ * function, every function it pushes gets a node of its own, found by the
+ * function instead, and the node of the site only collects what the callees
+ * of the call under way spend, until the call pops and it is known whose
+ * callees they were. Of the call the site is found out in, the callees that
+ * the first function had called before stay with the first function.
+ */
+NO_INSTRUMENT void split_site(thread_state_t& state, frame_t& frame,
+                              const void* func){
+  auto& tree = state.tree;
+  auto site = frame.node;
+  auto parent = tree.nodes()[site].parent;
+  auto node = tree.child(parent, func);
+  if(!tree.nodes()[site].shared){
+    tree.nodes()[site].shared = true;
+    // the newest children come first
+    auto id = tree.nodes()[site].first_child;
+    for(; id >= frame.first_node; id = tree.nodes()[id].next_sibling){
+      auto to = tree.child(node, tree.nodes()[id].site);
+      tree.move(id, to);
+    }
+    auto first = tree.child(parent, tree.nodes()[site].func);
+    tree.move(site, first);
+  } else {
+    tree.move(site, node);
+  }
+  frame.node = node;
+}
+
+NO_INSTRUMENT void pop_function(const void* func){
+  auto& state = this_thread_state();
+#ifndef EAUDIT_NO_THROTTLE
+  if(state.throttled_depth > 0){
+    --state.throttled_depth;
+    return;
+  }
+#endif
+  // a thread may return from functions it was started in
+  if(state.cur_stats.size() <= 1){
+    return;
+  }
+  ++state.probes;
+  auto& frame = state.cur_stats.back();
+  const auto& site = state.tree.nodes()[frame.node];
+  if(site.shared || (site.func != func && site.func != nullptr)){
+    split_site(state, frame, func);
+  }
+  auto now = __rdtsc();
+  auto did_read = read_due(state, now) && read_counters(state);
+  auto& node = state.tree.nodes()[frame.node];
+  node.func = func;
+  ++node.calls;
+#ifndef EAUDIT_NO_THROTTLE
+  node.window_ticks += now - frame.start;
+  if((node.calls & (kThrottleWindow - 1)) == 0){
+    consider_throttling(node, now);
+  }
+#endif
   if(did_read){
     print("good read!\n");
 #ifdef EAUDIT_RECORD_ALL
-    total_stats()[func_name].emplace_back(cur_stats().top());
+    node.exclusive.add(frame.stats);
 #else
-    auto& top = cur_stats().top();
-    auto& total = total_stats()[func_name];
-    total = total + top;
+    node.exclusive = node.exclusive + frame.stats;
 #endif
-  } 
-  cur_stats().pop();
+  }
+#ifdef EAUDIT_EVENT_LOG
+  events::record_t record;
+  record.start = frame.start;
+  record.end = now;
+  record.node = frame.node;
+  if(did_read){
+    record.flags = events::kMeasured;
+    events::measurement_t measurement;
+    measurement.time = frame.stats.time;
+    for(int i = 0; i < kNumCounters; ++i){
+      measurement.counters[i] = frame.stats.counters[i];
+    }
+    state.log.append(record, measurement);
+  } else {
+    record.flags = 0;
+    state.log.append(record);
+  }
+#endif
+  state.cur_stats.pop_back();
 }
 
-void EAUDIT_shutdown(){
-  print("shutdown\n");
-  struct itimerval work_time;
-  work_time.it_value.tv_sec = 0;
-  work_time.it_value.tv_usec = 0;
-  work_time.it_interval.tv_sec = 0;
-  work_time.it_interval.tv_usec = 0;
-  setitimer(ITIMER_REAL, &work_time, nullptr);
+NO_INSTRUMENT void EAUDIT_pop(const char* func_name){
+  print("popping %s\n", func_name);
+  pop_function(func_name);
+}
 
+NO_INSTRUMENT void EAUDIT_pop_address(void* func_addr){
+  print("popping %p\n", func_addr);
+  if(!popped_by_address().load(memory_order_relaxed)){
+    popped_by_address() = true;
+  }
+  pop_function(func_addr);
+}
+
+#ifdef EAUDIT_NO_BYFL
+/*
+ * What byfl-common does, for builds without byfl.
+ */
+NO_INSTRUMENT string demangle_func_name(const string& name){
+  int status;
+  char* demangled = abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status);
+  if(status != 0){
+    return name;
+  }
+  string result(demangled);
+  free(demangled);
+  return result;
+}
+#endif
+
+/*
+ * Name functions by their addresses, like byfl would have: with their mangled
+ * names. Exported functions are found by the dynamic linker, everything else
+ * by addr2line in the debug info of the module, a few hundred addresses per
+ * call.
+ */
+NO_INSTRUMENT map<const void*, string> name_addresses(const vector<const void*>& addrs){
+  map<const void*, string> names;
+  map<string, vector<pair<const void*, uintptr_t> > > module_addrs;
+  for(auto addr : addrs){
+    Dl_info info;
+    if(dladdr(addr, &info) == 0){
+      stringstream name;
+      name << addr;
+      names[addr] = name.str();
+      continue;
+    }
+    if(info.dli_sname != nullptr && info.dli_saddr == addr){
+      names[addr] = info.dli_sname;
+      continue;
+    }
+    // addr2line wants addresses relative to where position-independent
+    // modules were loaded
+    auto header = static_cast<const ElfW(Ehdr)*>(info.dli_fbase);
+    auto offset = header->e_type == ET_DYN ? (uintptr_t)info.dli_fbase : 0;
+    string module = info.dli_fname;
+    if(module.empty() || access(module.c_str(), R_OK) != 0){
+      module = "/proc/self/exe";
+    }
+    module_addrs[module].emplace_back(addr, (uintptr_t)addr - offset);
+  }
+
+  for(auto& module : module_addrs){
+    auto& addrs = module.second;
+    auto base_name = module.first.substr(module.first.find_last_of('/') + 1);
+    for(size_t first = 0; first < addrs.size(); first += kAddressesPerCall){
+      auto last = min(addrs.size(), first + kAddressesPerCall);
+      stringstream command;
+      command << "addr2line -f -e '" << module.first << "'";
+      for(auto i = first; i < last; ++i){
+        command << " " << hex << showbase << addrs[i].second;
+      }
+      auto output = popen(command.str().c_str(), "r");
+      char func_name[4096], file_line[4096];
+      for(auto i = first; i < last; ++i){
+        string name;
+        if(output != nullptr &&
+           fgets(func_name, sizeof(func_name), output) != nullptr &&
+           fgets(file_line, sizeof(file_line), output) != nullptr){
+          name = func_name;
+          name.erase(name.find_last_not_of('\n') + 1);
+        }
+        if(name.empty() || name == "??"){
+          stringstream unknown;
+          unknown << addrs[i].first << " in " << base_name;
+          name = unknown.str();
+        }
+        names[addrs[i].first] = name;
+      }
+      if(output != nullptr){
+        pclose(output);
+      }
+    }
+  }
+  return names;
+}
+
+/*
+ * A calling context of the tree merged over all threads.
+ */
+struct context_t{
+  string name; // demangled
+  unsigned parent;
+  unsigned depth;
+  unsigned long long calls;       // throttled ones included
+  unsigned long long throttled_calls;
+  function_stats_t exclusive;
+  stats_t inclusive;
+  stats_t correction;
+};
+
+/*
+ * Merge the trees of all threads into one, in which contexts are told apart
+ * by the names of their functions. The threads' trees are only read, so the
+ * other threads should be done by now. Parents come before their children.
+ */
+NO_INSTRUMENT vector<context_t> merge_thread_trees(){
+  map<const void*, string> names;
+  if(popped_by_address()){
+    vector<const void*> addrs;
+    for(auto state = thread_states().load(); state != nullptr; state = state->next){
+      for(const auto& node : state->tree.nodes()){
+        if(node.func != nullptr){
+          addrs.push_back(node.func);
+        }
+      }
+    }
+    names = name_addresses(addrs);
+  }
+
+  const unsigned kScratch = -1;
+  vector<context_t> merged(1);
+  merged[0].name = "(all threads)";
+  map<pair<unsigned, string>, unsigned> children;
+  for(auto state = thread_states().load(); state != nullptr; state = state->next){
+    const auto& nodes = state->tree.nodes();
+    vector<unsigned> ids(nodes.size(), 0); // -> merged context
+#ifdef EAUDIT_EVENT_LOG
+    state->node_names.assign(nodes.size(), string());
+#endif
+    for(unsigned id = 1; id < nodes.size(); ++id){
+      const auto& node = nodes[id];
+      string name = "(still running)";
+      if(node.func != nullptr){
+        auto name_iter = names.find(node.func);
+        if(name_iter == names.end()){
+          name_iter = names.emplace(
+            node.func, static_cast<const char*>(node.func)).first;
+        }
+        name = name_iter->second;
+      }
+#ifdef EAUDIT_EVENT_LOG
+      state->node_names[id] = demangle_func_name(name);
+#endif
+      if(node.shared || ids[node.parent] == kScratch){
+        // what the calls of shared sites recorded was moved already
+        ids[id] = kScratch;
+        continue;
+      }
+      auto parent = ids[node.parent];
+      auto inserted = children.emplace(make_pair(parent, name), merged.size());
+      if(inserted.second){
+        merged.emplace_back();
+        merged.back().name = name;
+        merged.back().parent = parent;
+        merged.back().depth = merged[parent].depth + 1;
+      }
+      ids[id] = inserted.first->second;
+      auto& context = merged[ids[id]];
+      context.calls += node.calls + node.throttled_calls;
+      context.throttled_calls += node.throttled_calls;
 #ifdef EAUDIT_RECORD_ALL
-  vector<pair<string, vector<stats_t> > > stats;
+      context.exclusive.merge(node.exclusive);
 #else
-  vector<pair<string, stats_t> > stats;
+      context.exclusive = context.exclusive + node.exclusive;
 #endif
-  cout << "size: " << total_stats().size() << endl;
-  for(auto& func : total_stats()){
-    auto name = demangle_func_name(func.first);
-    stats.emplace_back(name, func.second);
+      context.correction = context.correction + node.correction;
+    }
+  }
+  // every context is in the inclusive stats of all of its ancestors
+  for(auto id = merged.size() - 1; id > 0; --id){
+    auto& context = merged[id];
+    context.inclusive = context.inclusive + sum(context.exclusive);
+    merged[context.parent].inclusive =
+      merged[context.parent].inclusive + context.inclusive;
+  }
+  for(auto& context : merged){
+    context.name = demangle_func_name(context.name);
   }
+  return merged;
+}
 
-  stable_sort(stats.begin(), stats.end(),
+/*
+ * What every function spent itself, over all of its contexts.
+ */
+NO_INSTRUMENT total_stats_t function_totals(const vector<context_t>& contexts){
+  total_stats_t totals;
+  for(unsigned id = 1; id < contexts.size(); ++id){
+    const auto& context = contexts[id];
 #ifdef EAUDIT_RECORD_ALL
-      [](const pair<string, vector<stats_t> >& a,
-         const pair<string, vector<stats_t> >& b){
-        stats_t sum_a = accumulate(a.second.begin(), a.second.end(), stats_t{});
-        stats_t sum_b = accumulate(b.second.begin(), b.second.end(), stats_t{});
-        return sum_a.time > sum_b.time;
-      }
+    totals[context.name].merge(context.exclusive);
 #else
-      [](const pair<string, stats_t>& a,
-         const pair<string, stats_t>& b){ return a.second.time > b.second.time; }
+    auto& total = totals[context.name];
+    total = total + context.exclusive;
 #endif
-      );
+  }
+  return totals;
+}
+
+/*
+ * The probe overhead taken out of every function, over all of its contexts.
+ */
+NO_INSTRUMENT map<string, stats_t> function_corrections(const vector<context_t>& contexts){
+  map<string, stats_t> corrections;
+  for(unsigned id = 1; id < contexts.size(); ++id){
+    auto& correction = corrections[contexts[id].name];
+    correction = correction + contexts[id].correction;
+  }
+  return corrections;
+}
+
+#ifndef EAUDIT_NO_THROTTLE
+/*
+ * The functions that were throttled in any context, the most often throttled
+ * first: what they spent then is in the functions that called them. The
+ * functions they called in turn are not even counted.
+ */
+NO_INSTRUMENT void write_throttled(const vector<context_t>& contexts){
+  struct throttled_t{
+    string name;
+    unsigned long long calls;
+    unsigned long long throttled_calls;
+  };
+  vector<throttled_t> funcs;
+  map<string, unsigned> func_ids;
+  for(unsigned id = 1; id < contexts.size(); ++id){
+    const auto& context = contexts[id];
+    auto inserted = func_ids.emplace(context.name, funcs.size());
+    if(inserted.second){
+      funcs.push_back(throttled_t{context.name, 0, 0});
+    }
+    auto& func = funcs[inserted.first->second];
+    func.calls += context.calls;
+    func.throttled_calls += context.throttled_calls;
+  }
+  vector<throttled_t> throttled;
+  for(const auto& func : funcs){
+    if(func.throttled_calls > 0){
+      throttled.push_back(func);
+    }
+  }
+  stable_sort(throttled.begin(), throttled.end(),
+      [](const throttled_t& a, const throttled_t& b){
+        return a.throttled_calls > b.throttled_calls;
+      });
+  cerr << "throttled: " << throttled.size() << endl;
+
+  ofstream myfile;
+  myfile.open("eaudit.throttled.tsv");
+  myfile << "Func Name\tCalls\tThrottled Calls" << endl;
+  for(const auto& func : throttled){
+    myfile << func.name << "\t" << func.calls
+           << "\t" << func.throttled_calls << endl;
+  }
+  myfile.close();
+}
+#endif
+
+/*
+ * The merged tree, depth first, the most expensive children first, with the
+ * names indented by depth.
+ */
+NO_INSTRUMENT void write_cct(const vector<context_t>& contexts){
+  vector<vector<unsigned> > children(contexts.size());
+  for(unsigned id = 1; id < contexts.size(); ++id){
+    children[contexts[id].parent].push_back(id);
+  }
+  for(auto& ids : children){
+    stable_sort(ids.begin(), ids.end(), [&](unsigned a, unsigned b){
+        return contexts[a].inclusive.time > contexts[b].inclusive.time;
+      });
+  }
+
+  ofstream myfile;
+  myfile.open("eaudit.cct.tsv");
+  myfile << "Node\tParent\tDepth\tFunc Name\tCalls"
+         << "\tExcl Time(s)\tIncl Time(s)";
+  for(int i = 0; i < kNumCounters; ++i){
+    myfile << "\tExcl " << kCounterNames[i] << "\tIncl " << kCounterNames[i];
+  }
+  myfile << endl;
+
+  vector<unsigned> stack{0};
+  while(!stack.empty()){
+    auto id = stack.back();
+    stack.pop_back();
+    const auto& context = contexts[id];
+    auto exclusive = sum(context.exclusive);
+    myfile << id << "\t";
+    if(id == 0){
+      myfile << "-";
+    } else {
+      myfile << context.parent;
+    }
+    myfile << "\t" << context.depth
+           << "\t" << string(2 * context.depth, ' ') << context.name
+           << "\t" << context.calls
+           << "\t" << exclusive.time * kNanoToBase
+           << "\t" << context.inclusive.time * kNanoToBase;
+    for(int i = 0; i < kNumCounters; ++i){
+      myfile << "\t" << exclusive.counters[i]
+             << "\t" << context.inclusive.counters[i];
+    }
+    myfile << endl;
+    stack.insert(stack.end(), children[id].rbegin(), children[id].rend());
+  }
+  myfile.close();
+}
+
+/*
+ * Time and energy spent in a function called from one place: in the function
+ * itself and in the functions it called.
+ */
+struct arc_t{
+  unsigned long long calls;
+  stats_t self;
+  stats_t children;
+};
+
+struct call_graph_entry_t{
+  string name;
+  unsigned long long calls;
+  stats_t self;
+  stats_t total;           // not counting recursive calls twice
+  map<unsigned, arc_t> callers; // by entry, -1 for the thread itself
+  map<unsigned, arc_t> callees; // by entry
+};
+
+NO_INSTRUMENT void write_arc_stats(ostream& out, const stats_t& self, const stats_t& children){
+  out << fixed << setprecision(4)
+      << setw(10) << self.time * kNanoToBase
+      << setw(10) << children.time * kNanoToBase
+      << setw(14) << self.counters[kEnergyCounter]
+      << setw(14) << children.counters[kEnergyCounter];
+}
+
+/*
+ * A call graph of the functions like the one of gprof: the entry of every
+ * function, with the functions that called it above and the functions it
+ * called below, by total time. Self and children are the seconds and energy
+ * the function and its callees spent, over all contexts it was called from,
+ * or those of one of its callers or callees.
+ */
+NO_INSTRUMENT void write_call_graph(const vector<context_t>& contexts){
+  const unsigned kSpontaneous = -1;
+  vector<call_graph_entry_t> entries;
+  map<string, unsigned> entry_ids;
+  vector<unsigned> context_entries(contexts.size(), kSpontaneous);
+  for(unsigned id = 1; id < contexts.size(); ++id){
+    const auto& context = contexts[id];
+    auto inserted = entry_ids.emplace(context.name, entries.size());
+    if(inserted.second){
+      entries.emplace_back();
+      entries.back().name = context.name;
+    }
+    auto entry_id = context_entries[id] = inserted.first->second;
+    auto& entry = entries[entry_id];
+    auto exclusive = sum(context.exclusive);
+    stats_t children;
+    children.time = context.inclusive.time - exclusive.time;
+    for(int i = 0; i < kNumCounters; ++i){
+      children.counters[i] = context.inclusive.counters[i] - exclusive.counters[i];
+    }
+
+    entry.calls += context.calls;
+    entry.self = entry.self + exclusive;
+    // the time of a recursive call is in the total of the outermost one
+    auto recursive = false;
+    for(auto parent = context.parent; parent != 0; parent = contexts[parent].parent){
+      if(context_entries[parent] == entry_id){
+        recursive = true;
+        break;
+      }
+    }
+    if(!recursive){
+      entry.total = entry.total + context.inclusive;
+    }
+
+    auto caller_id = context_entries[context.parent];
+    auto& caller_arc = entry.callers[caller_id];
+    caller_arc.calls += context.calls;
+    if(caller_id == entry_id){
+      // like gprof, only count recursive calls, their time is in the
+      // outermost call's already
+      entries[caller_id].callees[entry_id].calls += context.calls;
+      continue;
+    }
+    caller_arc.self = caller_arc.self + exclusive;
+    caller_arc.children = caller_arc.children + children;
+    if(caller_id != kSpontaneous){
+      auto& callee_arc = entries[caller_id].callees[entry_id];
+      callee_arc.calls += context.calls;
+      callee_arc.self = callee_arc.self + exclusive;
+      callee_arc.children = callee_arc.children + children;
+    }
+  }
+
+  vector<unsigned> order(entries.size());
+  for(unsigned i = 0; i < order.size(); ++i){
+    order[i] = i;
+  }
+  stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b){
+      return entries[a].total.time > entries[b].total.time;
+    });
+  vector<unsigned> index(entries.size()); // entry -> index in the output
+  for(unsigned i = 0; i < order.size(); ++i){
+    index[order[i]] = i + 1;
+  }
+  auto all_time = contexts[0].inclusive.time;
+
+  ofstream myfile;
+  myfile.open("eaudit.callgraph.txt");
+  myfile << "Energy is " << kCounterNames[kEnergyCounter] << ".\n\n"
+         << "index  % time      self  children        self E    children E"
+         << "        called  name" << endl;
+  for(auto entry_id : order){
+    const auto& entry = entries[entry_id];
+    for(const auto& caller : entry.callers){
+      myfile << setw(15) << "";
+      write_arc_stats(myfile, caller.second.self, caller.second.children);
+      if(caller.first == kSpontaneous){
+        myfile << setw(14) << "" << "      <spontaneous>" << endl;
+        continue;
+      }
+      stringstream called;
+      called << caller.second.calls << "/" << entry.calls;
+      myfile << setw(14) << called.str() << "      "
+             << entries[caller.first].name << " [" << index[caller.first] << "]"
+             << endl;
+    }
+
+    stringstream entry_index;
+    entry_index << "[" << index[entry_id] << "]";
+    stats_t children;
+    children.time = entry.total.time - entry.self.time;
+    for(int i = 0; i < kNumCounters; ++i){
+      children.counters[i] = entry.total.counters[i] - entry.self.counters[i];
+    }
+    myfile << left << setw(7) << entry_index.str() << right
+           << fixed << setprecision(1)
+           << setw(8) << (all_time > 0 ? 100.0 * entry.total.time / all_time : 0);
+    write_arc_stats(myfile, entry.self, children);
+    myfile << setw(14) << entry.calls << "  "
+           << entry.name << " " << entry_index.str() << endl;
+
+    for(const auto& callee : entry.callees){
+      myfile << setw(15) << "";
+      write_arc_stats(myfile, callee.second.self, callee.second.children);
+      stringstream called;
+      called << callee.second.calls << "/" << entries[callee.first].calls;
+      myfile << setw(14) << called.str() << "      "
+             << entries[callee.first].name << " [" << index[callee.first] << "]"
+             << endl;
+    }
+    myfile << string(96, '-') << endl;
+  }
+  myfile.close();
+}
+
+NO_INSTRUMENT void EAUDIT_shutdown(){
+  print("shutdown\n");
+  for(auto state = thread_states().load(); state != nullptr; state = state->next){
+    stop_thread_timer(*state);
+  }
+
+  vector<pair<string, function_stats_t> > stats;
+  auto contexts = merge_thread_trees();
+#ifdef EAUDIT_EVENT_LOG
+  for(auto state = thread_states().load(); state != nullptr; state = state->next){
+    stringstream names;
+    for(unsigned id = 1; id < state->node_names.size(); ++id){
+      names << id << "\t" << state->node_names[id] << "\n";
+    }
+    state->log.close(names.str());
+  }
+#endif
+  auto total_stats = function_totals(contexts);
+  auto corrections = function_corrections(contexts);
+  cout << "size: " << total_stats.size() << endl;
+  // not on stdout, which is the program's
+  const auto& cost = probe_cost();
+  cerr << "Probe cost: " << cost.time << " ns";
+  for(int i = 0; i < kNumCounters; ++i){
+    cerr << ", " << cost.counters[i] << " " << kCounterNames[i];
+  }
+  cerr << endl;
+  if(unreliable_reads() > 0){
+    cerr << "Reads that may have missed a counter wrap: " << unreliable_reads()
+         << endl;
+  }
+  for(auto& func : total_stats){
+    stats.emplace_back(func.first, func.second);
+  }
+
+  stable_sort(stats.begin(), stats.end(),
+      [](const pair<string, function_stats_t>& a,
+         const pair<string, function_stats_t>& b){
+        return sum(a.second).time > sum(b.second).time;
+      });
 
   ofstream myfile;
   myfile.open("eaudit.tsv");
@@ -267,44 +1539,44 @@ void EAUDIT_shutdown(){
          << "\t" << "Time(s)";
 #ifdef EAUDIT_RECORD_ALL
   myfile << "\tavg\tstddev";
+  for(auto quantile_name : kQuantileNames){
+    myfile << "\t" << quantile_name;
+  }
 #endif
   for(int i = 0; i < kNumCounters; ++i){
     myfile << "\t" << kCounterNames[i];
 #ifdef EAUDIT_RECORD_ALL
     myfile << "\tavg\tstddev";
+    for(auto quantile_name : kQuantileNames){
+      myfile << "\t" << quantile_name;
+    }
 #endif
   }
+  // taken out of the columns above
+  myfile << "\tProbe Time(s)";
+  for(int i = 0; i < kNumCounters; ++i){
+    myfile << "\tProbe " << kCounterNames[i];
+  }
   myfile << endl;
 
   for(auto& func : stats){
 #ifdef EAUDIT_RECORD_ALL
-    stats_t func_sum = accumulate(func.second.begin(), func.second.end(), stats_t{});
+    const auto& func_sum = func.second.total;
     if(func_sum.time == 0) continue;
-    stats_t func_dev;
-    auto count = func.second.size();
-    stats_t func_avg;
-    func_avg.time = func_sum.time / (double) count;
-    for(int i = 0; i < kNumCounters; ++i){
-      func_avg.counters[i] = func_sum.counters[i] / (double) count;
-    }
-    for(auto& val : func.second){
-      func_dev.time += pow(val.time - func_avg.time, 2);
-      for(int i = 0; i < kNumCounters; ++i){
-        func_dev.counters[i] += pow(val.counters[i] - func_avg.counters[i], 2);
-      }
-    }
-    func_dev.time = sqrt(func_dev.time / count);
-    for(int i = 0; i < kNumCounters; ++i){
-      func_dev.counters[i] = sqrt(func_dev.counters[i] / count);
-    }
     myfile << func.first
            << "\t" << func_sum.time * kNanoToBase
-           << "\t" << func_avg.time * kNanoToBase
-           << "\t" << func_dev.time * kNanoToBase;
+           << "\t" << func.second.moments[0].mean() * kNanoToBase
+           << "\t" << func.second.moments[0].stddev() * kNanoToBase;
+    for(auto quantile : kQuantiles){
+      myfile << "\t" << func.second.quantiles[0].quantile(quantile) * kNanoToBase;
+    }
     for(int i = 0; i < kNumCounters; ++i){
       myfile << "\t" << func_sum.counters[i]
-             << "\t" << func_avg.counters[i]
-             << "\t" << func_dev.counters[i];
+             << "\t" << func.second.moments[i + 1].mean()
+             << "\t" << func.second.moments[i + 1].stddev();
+      for(auto quantile : kQuantiles){
+        myfile << "\t" << func.second.quantiles[i + 1].quantile(quantile);
+      }
     }
 #else
     if(func.second.time == 0) continue;
@@ -314,15 +1586,33 @@ void EAUDIT_shutdown(){
       myfile << "\t" << func.second.counters[i];
     }
 #endif
+    const auto& correction = corrections[func.first];
+    myfile << "\t" << correction.time * kNanoToBase;
+    for(int i = 0; i < kNumCounters; ++i){
+      myfile << "\t" << correction.counters[i];
+    }
     myfile << endl;
   }
   myfile.close();
+
+  write_cct(contexts);
+  write_call_graph(contexts);
+#ifndef EAUDIT_NO_THROTTLE
+  write_throttled(contexts);
+#endif
 }
 
-void overflow(int signum){
+/*
+ * Runs on whatever thread the timer interrupted, possibly in the middle of a
+ * push or pop, so it must not touch the shadow stack, PAPI, or stdio: it only
+ * makes the thread's next push or pop read the counters.
+ */
+NO_INSTRUMENT void overflow(int signum){
   if(signum == SIGALRM){
-    print("overflow\n");
-    read_rapl();
+    auto state = current_thread_state;
+    if(state != nullptr){
+      state->read_deadline = 0;
+    }
   }
 }
 
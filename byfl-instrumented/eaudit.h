@@ -3,14 +3,22 @@
 
 #include <vector>
 
-void EAUDIT_push();
-void EAUDIT_pop(const char* func_name);
-void EAUDIT_shutdown();
+// The runtime must not call the -finstrument-functions hooks itself
+#define NO_INSTRUMENT __attribute__((no_instrument_function))
+
+NO_INSTRUMENT void EAUDIT_push();
+NO_INSTRUMENT void EAUDIT_pop(const char* func_name);
+// For front ends that only know the address of the function, such as
+// -finstrument-functions. The name is looked up at shutdown.
+NO_INSTRUMENT void EAUDIT_push_address(void* func_addr);
+NO_INSTRUMENT void EAUDIT_pop_address(void* func_addr);
+NO_INSTRUMENT void EAUDIT_shutdown();
 
 /*void overflow(int eventset, void* address, long long overflow_vector, 
               void* context);*/
-void overflow(int signum);
-void init_papi(std::vector<int>& eventsets);
-bool read_rapl();
+NO_INSTRUMENT void overflow(int signum);
+NO_INSTRUMENT void init_papi();
+NO_INSTRUMENT void init_thread(std::vector<int>& eventsets);
+NO_INSTRUMENT bool read_rapl();
 
 #endif // EAUDIT_H
@@ -0,0 +1,166 @@
+#pragma once
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+
+namespace events{
+/*
+ * The log of one thread: a header, a record per call the thread returned
+ * from, in the order it returned, and the names of the calling contexts the
+ * records refer to, as "node\tname\n" lines. The few calls at the end of
+ * which the counters were read are followed by what they measured, in the
+ * space of kMeasurementRecords records, so that the others take up as little
+ * of it as possible.
+ */
+const uint32_t kMagic = 0x44554145; // "EAUD"
+const uint32_t kVersion = 1;
+const unsigned kCounters = 4;
+const size_t kNameSize = 64;
+// where the records start, so that they can be mapped a page at a time
+const off_t kRecordsOffset = 4096;
+
+// record_t::flags
+const uint32_t kMeasured = 1; // followed by a measurement_t
+
+struct header_t{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t pid;
+  uint32_t tid;
+  double tsc_per_nsec;
+  uint64_t records; // including the space of the measurements
+  uint64_t names_offset;
+  char counter_names[kCounters][kNameSize];
+};
+
+struct record_t{
+  uint64_t start; // TSC at the push
+  uint64_t end;   // TSC at the pop
+  uint32_t node;  // calling context, of the thread
+  uint32_t flags;
+};
+
+/*
+ * What the function spent itself, as attributed to it.
+ */
+struct measurement_t{
+  int64_t time; // nanoseconds
+  int64_t counters[kCounters];
+};
+
+const size_t kMeasurementRecords =
+  (sizeof(measurement_t) + sizeof(record_t) - 1) / sizeof(record_t);
+
+/*
+ * Appends records to a log through a buffer that is written out whenever it
+ * fills up, so that appending is a copy to memory. Writing through a shared
+ * mapping of the file instead costs a page fault per page, as the kernel
+ * tracks which pages were written, which is more than a copy per record.
+ */
+class Writer{
+ public:
+  Writer() : fd_{-1}, next_{nullptr}, end_{nullptr}, records_{0} {}
+
+  ~Writer(){
+    delete[] buffer_;
+  }
+
+  Writer(const Writer&) = delete;
+  Writer& operator=(const Writer&) = delete;
+
+  void open(const std::string& path, const header_t& header){
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd_ == -1 || lseek(fd_, kRecordsOffset, SEEK_SET) == -1){
+      fprintf(stderr, "Unable to open event log %s: %s\n", path.c_str(),
+              strerror(errno));
+      exit(-1);
+    }
+    header_ = header;
+    // value-initialized, so that it is faulted in now rather than while
+    // appending
+    buffer_ = new record_t[kBufferRecords]();
+    next_ = buffer_;
+    end_ = buffer_ + kBufferRecords;
+  }
+
+  // records appended once the log is closed are dropped
+  void append(const record_t& record){
+    if(next_ == end_ && !flush()){
+      return;
+    }
+    *next_++ = record;
+  }
+
+  void append(const record_t& record, const measurement_t& measurement){
+    if(end_ - next_ < (std::ptrdiff_t)(1 + kMeasurementRecords) && !flush()){
+      return;
+    }
+    *next_++ = record;
+    memcpy(next_, &measurement, sizeof(measurement));
+    next_ += kMeasurementRecords;
+  }
+
+  /*
+   * Write out the rest of the records, and add the names.
+   */
+  void close(const std::string& names){
+    if(!flush()){
+      return;
+    }
+    header_.records = records_;
+    header_.names_offset = kRecordsOffset + records_ * sizeof(record_t);
+    if(!write_all(names.data(), names.size()) ||
+       pwrite(fd_, &header_, sizeof(header_), 0) != sizeof(header_)){
+      fprintf(stderr, "Unable to write event log: %s\n", strerror(errno));
+    }
+    ::close(fd_);
+    fd_ = -1;
+    next_ = end_ = nullptr;
+  }
+
+ private:
+  static const size_t kBufferRecords = 1 << 15;
+
+  bool flush(){
+    if(fd_ == -1){
+      return false;
+    }
+    if(!write_all(buffer_, (next_ - buffer_) * sizeof(record_t))){
+      fprintf(stderr, "Unable to write event log: %s\n", strerror(errno));
+      exit(-1);
+    }
+    records_ += next_ - buffer_;
+    next_ = buffer_;
+    return true;
+  }
+
+  bool write_all(const void* data, size_t size){
+    auto bytes = static_cast<const char*>(data);
+    while(size > 0){
+      auto written = write(fd_, bytes, size);
+      if(written == -1){
+        if(errno == EINTR){
+          continue;
+        }
+        return false;
+      }
+      bytes += written;
+      size -= written;
+    }
+    return true;
+  }
+
+  int fd_;
+  header_t header_;
+  record_t* buffer_ = nullptr;
+  record_t* next_;
+  record_t* end_;
+  uint64_t records_; // written out
+};
+}
@@ -0,0 +1,150 @@
+#pragma once
+#include <cmath>
+#include <vector>
+
+namespace stream{
+/*
+ * Mean and variance of a series of values, updated one value at a time
+ * (Welford), and merged like Chan et al. do, so that neither needs the
+ * values themselves.
+ */
+class Moments{
+ public:
+  Moments() : count_{0}, mean_{0}, m2_{0} {}
+
+  void add(double value){
+    ++count_;
+    auto delta = value - mean_;
+    mean_ += delta / count_;
+    m2_ += delta * (value - mean_);
+  }
+
+  void merge(const Moments& other){
+    if(other.count_ == 0){
+      return;
+    }
+    if(count_ == 0){
+      *this = other;
+      return;
+    }
+    auto count = count_ + other.count_;
+    auto delta = other.mean_ - mean_;
+    mean_ += delta * other.count_ / count;
+    m2_ += other.m2_ + delta * delta * count_ / count * other.count_;
+    count_ = count;
+  }
+
+  unsigned long long count() const { return count_; }
+  double mean() const { return mean_; }
+  // of the values themselves, not of a sample of them
+  double stddev() const { return count_ > 0 ? std::sqrt(m2_ / count_) : 0; }
+
+ private:
+  unsigned long long count_;
+  double mean_;
+  double m2_; // sum of squared deviations from the mean
+};
+
+/*
+ * Quantiles of a series of non-negative values to within a relative error,
+ * by counting the values in buckets whose bounds grow geometrically (as in
+ * DDSketch). Values from 1 to 1e15 take at most about 1700 buckets at 1%,
+ * and only the range between the smallest and largest value is stored; past
+ * kMaxBuckets, the smallest values are lumped together, as the quantiles of
+ * interest are the high ones.
+ */
+class QuantileSketch{
+ public:
+  QuantileSketch() : zeros_{0}, count_{0}, first_index_{0} {}
+
+  void add(double value){
+    ++count_;
+    if(value < kMinValue){
+      ++zeros_;
+      return;
+    }
+    add_to_bucket(index(value), 1);
+  }
+
+  void merge(const QuantileSketch& other){
+    count_ += other.count_;
+    zeros_ += other.zeros_;
+    for(unsigned i = 0; i < other.counts_.size(); ++i){
+      if(other.counts_[i] > 0){
+        add_to_bucket(other.first_index_ + i, other.counts_[i]);
+      }
+    }
+  }
+
+  /*
+   * The value of rank q * (count - 1), for q in [0, 1], 0 if there are none.
+   */
+  double quantile(double q) const {
+    if(count_ == 0){
+      return 0;
+    }
+    auto rank = (unsigned long long)(q * (count_ - 1));
+    if(rank < zeros_){
+      return 0;
+    }
+    auto seen = zeros_;
+    for(unsigned i = 0; i < counts_.size(); ++i){
+      seen += counts_[i];
+      if(seen > rank){
+        return value(first_index_ + i);
+      }
+    }
+    return value(first_index_ + counts_.size() - 1);
+  }
+
+  unsigned long long count() const { return count_; }
+
+ private:
+  static constexpr double kRelativeAccuracy = 0.01;
+  static constexpr double kGamma = (1 + kRelativeAccuracy) / (1 - kRelativeAccuracy);
+  static constexpr double kMinValue = 1e-9;
+  static const unsigned kMaxBuckets = 2048;
+
+  // bucket i holds the values in (gamma^(i - 1), gamma^i]
+  static int index(double value){
+    return (int) std::ceil(std::log(value) / std::log(kGamma));
+  }
+
+  // within the relative accuracy of every value in the bucket
+  static double value(int index){
+    return 2 * std::pow(kGamma, index) / (kGamma + 1);
+  }
+
+  void add_to_bucket(int index, unsigned long long count){
+    if(counts_.empty()){
+      first_index_ = index;
+      counts_.push_back(0);
+    } else if(index < first_index_){
+      if(first_index_ + (int) counts_.size() - index > (int) kMaxBuckets){
+        // too small to keep apart
+        counts_.front() += count;
+        return;
+      }
+      counts_.insert(counts_.begin(), first_index_ - index, 0);
+      first_index_ = index;
+    } else if(index >= first_index_ + (int) counts_.size()){
+      counts_.resize(index - first_index_ + 1, 0);
+      if(counts_.size() > kMaxBuckets){
+        auto excess = counts_.size() - kMaxBuckets;
+        for(unsigned i = 0; i < excess; ++i){
+          counts_[excess] += counts_[i];
+        }
+        counts_.erase(counts_.begin(), counts_.begin() + excess);
+        first_index_ += excess;
+      }
+    }
+    counts_[index - first_index_] += count;
+  }
+
+  unsigned long long zeros_; // values too small for any bucket
+  unsigned long long count_;
+  int first_index_;          // of counts_[0]
+  std::vector<unsigned long long> counts_;
+};
+
+}
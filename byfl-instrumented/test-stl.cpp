@@ -0,0 +1,25 @@
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+std::vector<int> squares(int n){
+  std::vector<int> values;
+  for(int i = 0; i < n; ++i){
+    values.push_back(i * i);
+  }
+  return values;
+}
+
+int main(){
+  std::map<std::string, int> sums;
+  for(int i = 0; i < 100; ++i){
+    for(auto value : squares(i)){
+      sums[std::to_string(i % 10)] += value;
+    }
+  }
+  for(const auto& sum : sums){
+    std::cout << sum.first << "\t" << sum.second << std::endl;
+  }
+  return 0;
+}
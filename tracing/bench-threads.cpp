@@ -0,0 +1,47 @@
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <pthread.h>
+#include <vector>
+
+using namespace std;
+
+// Stop-window benchmark profilee: a pool of threads that each alternate a
+// short burst of work with a short sleep, like the worker pools of our
+// services. Usage: bench-threads <threads> <seconds>
+
+struct param{
+  long seconds;
+};
+
+void* worker(void* p) {
+  long seconds = ((param*)p)->seconds;
+  time_t end = time(NULL) + seconds;
+  volatile long a = 0;
+  struct timespec nap = {0, 1000000};
+  while(time(NULL) < end){
+    for(long i = 0; i < 50000; ++i){
+      a += i;
+    }
+    nanosleep(&nap, NULL);
+  }
+  return NULL;
+}
+
+int main(int argc, char* argv[]){
+  if(argc != 3){
+    cerr << "Usage: bench-threads <threads> <seconds>\n";
+    return -1;
+  }
+  long nthreads = atol(argv[1]);
+  param p;
+  p.seconds = atol(argv[2]);
+  vector<pthread_t> threads(nthreads);
+  for(auto& thread : threads){
+    pthread_create(&thread, NULL, worker, &p);
+  }
+  for(auto& thread : threads){
+    pthread_join(thread, NULL);
+  }
+  return 0;
+}
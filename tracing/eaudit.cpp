@@ -1,23 +1,34 @@
 #include <algorithm>
+#include <atomic>
 #include <cerrno>
+#include <chrono>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fstream>
+#include <getopt.h>
+#include <iomanip>
 #include <iostream>
 #include <iterator>
 #include <limits>
 #include <map>
 #include <math.h>
+#include <memory>
+#include <numeric>
 #include <pthread.h>
 #include <sstream>
 #include <string>
 #include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/user.h>
 #include <sys/wait.h>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <unistd.h>
 #include <vector>
 
@@ -28,6 +39,13 @@
 
 #include "supereasyjson/json.h"
 #include "papi-helpers.hpp"
+#include "perf-helpers.hpp"
+#include "proc-helpers.hpp"
+#include "jit-symbols.hpp"
+#include "phases.hpp"
+#include "spsc-queue.hpp"
+#include "symbolizer.hpp"
+#include "syscalls.hpp"
 
 #ifdef DEBUG
 #define print(...) printf(__VA_ARGS__)
@@ -45,8 +63,9 @@ namespace{
 /*
  * Constants
  */
-const unsigned kProcStatIdx = 39;
 const long kDefaultSamplePeriodUsecs = 1000;
+// RAPL registers only update about once a millisecond
+const long kDefaultEnergyPeriodUsecs = 1000;
 const long kMicroToBase = 1e6;
 const long kNanoToBase = 1e9;
 const char* kDefaultPrefix = "eaudit";
@@ -55,7 +74,49 @@ const string kDRAMEnergyName = "rapl:::DRAM_ENERGY:PACKAGE0";
 const string kCoreEnergyName = "rapl:::PP0_ENERGY:PACKAGE0";
 const vector<string> kAllEnergyNames = {kCoreEnergyName, kPackageEnergyName, kDRAMEnergyName};
 const char* kDefaultModelName = "default.model";
-const int kTotalCoreAssignments = 5;
+// Follow every thread and process the profilee creates, across exec.
+const long kTraceOptions = PTRACE_O_EXITKILL | PTRACE_O_TRACECLONE |
+                           PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+                           PTRACE_O_TRACEEXEC | PTRACE_O_TRACEEXIT;
+// Records the sampler may get ahead of the aggregator by, and how long the
+// aggregator sleeps when it has caught up.
+const size_t kRecordQueueLength = 4096;
+const long kAggregatorIdleUsecs = 200;
+// Addresses the aggregator may have out for symbolization at once, and how
+// nice the symbolizer is to the profilee.
+const size_t kSymbolQueueLength = 65536;
+const int kSymbolizerNice = 19;
+// How often the symbolizer looks for JIT code that was replaced or moved
+const long kJitRefreshUsecs = 100000;
+// Sampled addresses in no mapping at all an image remembers, so as not to
+// reread its mappings for them again.
+const size_t kMaxUnmappedAddresses = 4096;
+// Cores retiring fewer instructions than this while none of our threads run on
+// them are considered idle, rather than busy with other processes.
+const double kIdleInstructionsPerUsec = 1.0;
+// Lines of source shown around every sampled line of the annotated source.
+const unsigned kAnnotateContext = 3;
+// Length of the rows of the energy time series, and how many of the hottest
+// functions every row keeps and the series file shows.
+const long kSeriesPeriodUsecs = 100000;
+const size_t kSeriesRowFunctions = 16;
+const size_t kSeriesFunctions = 8;
+// Phase detection on the rows of the time series, see phase::ChangeDetector
+const double kPhaseDrift = 0.1;
+const double kPhaseThreshold = 1.0;
+const unsigned kMinPhaseRows = 5;
+// Adaptive sample period: default bounds, how much wall time the overhead is
+// measured over before adjusting, and by how much the period changes at most
+// per adjustment.
+const long kDefaultMinPeriodUsecs = 100;
+const long kDefaultMaxPeriodUsecs = 100000;
+const long kOverheadWindowUsecs = 100000;
+const double kMaxPeriodChange = 2.0;
+// Confidence intervals in the profiles are 95% intervals. Entries whose
+// energy (or time, if they have none) is less certain than the maximum
+// relative error are not significant.
+const double kConfidenceZ = 1.96;
+const double kDefaultMaxError = 0.5;
 
 struct stats_t {
   long time; // in microseconds
@@ -256,22 +317,27 @@ void overflow(int signum, siginfo_t* info, void* context){
 }
 
 
-stats_t read_rapl(const event_info_t& eventsets, long period){
+/*
+ * Read the counters of a running eventset and return how much they advanced
+ * since the last read, whose values are kept in last_values.
+ */
+stats_t read_rapl(const event_info_t& eventsets, vector<long long>& last_values,
+                  long elapsed){
   stats_t res;
   res.counters.resize(eventsets.codes.size());
-  int retval=PAPI_stop(eventsets.set, &res.counters[0]);
+  int retval=PAPI_read(eventsets.set, &res.counters[0]);
   if(retval != PAPI_OK){
-    cerr << "Error: bad PAPI stop: ";
+    cerr << "Error: bad PAPI read: ";
     PAPI_perror(NULL);
     terminate();
   }
-  retval = PAPI_start(eventsets.set);
-  if(retval != PAPI_OK){
-    cerr << "Error: bad PAPI stop: ";
-    PAPI_perror(NULL);
-    terminate();
+  last_values.resize(res.counters.size());
+  for(unsigned i = 0; i < res.counters.size(); ++i){
+    auto cur_value = res.counters[i];
+    res.counters[i] -= last_values[i];
+    last_values[i] = cur_value;
   }
-  res.time = period;
+  res.time = elapsed;
   return res;
 }
 
@@ -299,34 +365,1340 @@ struct ProfileValue{
   double processor_energy, uncore_energy, dram_energy;
   double time;
   double instructions;
-  ProfileValue() : processor_energy{0}, uncore_energy(0), dram_energy(0), time{0}, instructions{0} {}
+  double samples;
+  // Sums of the squares of what every sample added. A value is the sum of a
+  // random number of samples, so its variance is about the sum of the squares
+  // of the samples.
+  double processor_energy_sq, uncore_energy_sq, dram_energy_sq;
+  double energy_sq; // of the total energy of every sample
+  double time_sq;
+  ProfileValue() : processor_energy{0}, uncore_energy(0), dram_energy(0), time{0}, instructions{0},
+                   samples{0}, processor_energy_sq{0}, uncore_energy_sq{0},
+                   dram_energy_sq{0}, energy_sq{0}, time_sq{0} {}
+  ProfileValue& operator+=(const ProfileValue& rhs){
+    processor_energy += rhs.processor_energy;
+    uncore_energy += rhs.uncore_energy;
+    dram_energy += rhs.dram_energy;
+    time += rhs.time;
+    instructions += rhs.instructions;
+    samples += rhs.samples;
+    processor_energy_sq += rhs.processor_energy_sq;
+    uncore_energy_sq += rhs.uncore_energy_sq;
+    dram_energy_sq += rhs.dram_energy_sq;
+    energy_sq += rhs.energy_sq;
+    time_sq += rhs.time_sq;
+    return *this;
+  }
+  // a sample that took the given time
+  void add_sample(double sample_time){
+    time += sample_time;
+    time_sq += sample_time * sample_time;
+    samples++;
+  }
+};
+
+/*
+ * An IP sample waiting for the end of the RAPL interval it falls in, to get
+ * its share of the energy of its core. Its time and instructions are known
+ * right away and have already been added to the profile.
+ */
+struct PendingSample{
+  ProfileValue* profile;
+  unsigned core;
+  double weight; // activity of the core in the slice that ended in the sample
+  // for the time series, see Aggregator::series_key()
+  long series_key;
+  double time, instructions;
 };
 
 struct ProfileEntry{
   string name;
   double processor_energy, uncore_energy, dram_energy, time, instructions;
+  double samples;
+  // half widths of the confidence intervals
+  double processor_energy_ci, uncore_energy_ci, dram_energy_ci, energy_ci, time_ci;
+};
+
+/*
+ * One program image: a process between its creation (or an exec) and its exit
+ * (or next exec). Every image has its own address space, so RIPs are only
+ * meaningful together with the image's mappings.
+ */
+struct ProcessImage{
+  int pid;
+  string exe_name;
+  vector<proc::mapping_t> mappings;
+  // executable anonymous memory as of the last reread, JIT code most likely,
+  // about which rereading the mappings would not tell us more
+  vector<proc::mapping_t> anonymous;
+  // sampled addresses that are not mapped even after rereading the mappings,
+  // so that we reread them only once per address
+  unordered_set<uintptr_t> unmapped;
+  // sampled since the mappings were last reread, and in none we know of
+  vector<uintptr_t> unknown;
+};
+
+/*
+ * The name and mappings of an image, sent to the aggregator whenever they
+ * change, so that it can place the addresses sampled in the image.
+ */
+struct ImageUpdate{
+  size_t image; // index into the images seen so far
+  int pid;
+  string exe_name;
+  vector<proc::mapping_t> mappings;
+};
+
+/*
+ * Where the sampler found a thread. With event-based sampling, also what the
+ * thread did since its previous sample.
+ */
+struct IpSample{
+  size_t image; // index into the images seen so far
+  unsigned core;
+  void* rip;     // if blocked, where the system call was made from, or null
+  double events; // instructions or cycles since the previous sample
+  double time;   // microseconds on a CPU since the previous sample
+  bool blocked;  // blocked in the kernel rather than running
+  long syscall;  // the system call the thread was in, or -1
+};
+
+/*
+ * Everything the sampler collected in one timer tick, handed over to the
+ * aggregator in one go.
+ */
+struct SampleRecord{
+  vector<stats_t> core_stats; // per-core counter deltas since the last record
+  vector<ImageUpdate> image_updates; // apply before adding the samples
+  vector<IpSample> samples;
+  bool read_energy; // true if this record ends a RAPL interval
+  stats_t energy;   // global energy counter deltas over that interval
+  bool last;        // no records follow
+  long sample_period; // microseconds, 0 with event-based sampling
+  SampleRecord() : read_energy{false}, last{false}, sample_period{0} {}
+};
+
+
+/*
+ * Bookkeeping for one traced thread.
+ */
+struct ThreadInfo{
+  int tgid; // the process this thread belongs to
+  int core; // where the thread last ran, refreshed at every sample
+  int stat_fd; // cached /proc/<tgid>/task/<tid>/stat, -1 until first sample
+  int syscall_fd; // cached /proc/<tgid>/task/<tid>/syscall, -1 until blocked
+  bool interrupted; // asked to stop for a sample, but hasn't stopped yet
+  bool stopped;     // stopped for a sample, has to be resumed
+  bool blocked;     // blocked at this sample, not stopped
+  long syscall;          // if blocked, the system call, or -1
+  uintptr_t blocked_pc;  // if blocked, where it was made from
+  // event-based sampling only
+  perf::sampler_t sampler;
+  uint64_t last_time_running; // on-CPU time of the thread at its last sample
+  explicit ThreadInfo(int tgid_) : tgid{tgid_}, core{0}, stat_fd{-1},
+    syscall_fd{-1}, interrupted{false}, stopped{false}, blocked{false},
+    syscall{-1}, blocked_pc{0}, last_time_running{0} {}
+};
+
+/*
+ * Latency of stopping, inspecting and resuming all threads for one sample,
+ * bucketed by powers of two of the number of threads stopped.
+ */
+struct StopWindowStats{
+  struct bucket_t{
+    long long samples, total_nsecs, max_nsecs;
+  };
+  map<unsigned, bucket_t> buckets;
+
+  void record(size_t nthreads, long long nsecs){
+    unsigned bucket = 0;
+    while((size_t{2} << bucket) <= nthreads){
+      ++bucket;
+    }
+    auto& b = buckets[bucket];
+    b.samples++;
+    b.total_nsecs += nsecs;
+    b.max_nsecs = max(b.max_nsecs, nsecs);
+  }
+
+  void report(ostream& out) const {
+    for(const auto& b : buckets){
+      out << "Stop window " << (1u << b.first) << "-"
+          << (2u << b.first) - 1 << " threads:\t"
+          << b.second.samples << " samples\t"
+          << b.second.total_nsecs / b.second.samples / 1e3 << " usecs mean\t"
+          << b.second.max_nsecs / 1e3 << " usecs max\n";
+    }
+  }
+};
+
+
+/*
+ * A sample period picked to keep the overhead of sampling at the target, and
+ * the overhead that made us pick it.
+ */
+struct PeriodChange{
+  long long time; // microseconds since the start of the run
+  long period;
+  double overhead; // fraction of wall time spent sampling before the change
+};
+
+
+/*
+ * Asks the aggregator's symbolizer to resolve the address of a location.
+ * An empty module asks it to finish.
+ */
+struct SymbolRequest{
+  unsigned location;
+  string module;
+  uintptr_t addr; // as addr2line expects it for the module
+  // for addresses outside of any module: the process, and its jitdump file
+  // if it has mapped one
+  int jit_pid;
+  string jitdump;
+};
+
+struct SymbolResult{
+  unsigned location;
+  string module;
+  sym::symbol_t symbol;
+};
+
+/*
+ * Resolves addresses to functions and source lines while the profilee runs,
+ * at a low priority, so that the profile is mostly symbolized by the time it
+ * exits. Keeps one addr2line running per module, and reads the symbols of
+ * JIT-compiled code from the files the runtime writes for perf.
+ */
+struct Symbolizer{
+  // max_cache bounds the number of cached names, 0 for no bound
+  explicit Symbolizer(size_t max_cache)
+    : requests_{kSymbolQueueLength}, results_{kSymbolQueueLength},
+      max_cache_{max_cache} {}
+
+  void run(){
+    // Only this thread; the addr2lines it starts inherit its priority.
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), kSymbolizerNice);
+    // An addr2line that died shows up as a failed write, not a signal
+    sigset_t pipe_signal;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, nullptr);
+    SymbolRequest request;
+    auto last_jit_refresh = chrono::steady_clock::now();
+    for(;;){
+      if(!requests_.pop(request)){
+        auto now = chrono::steady_clock::now();
+        if(now - last_jit_refresh >= chrono::microseconds(kJitRefreshUsecs)){
+          for(auto& jit_symbols : jit_symbols_){
+            refresh_jit(*jit_symbols.second);
+          }
+          last_jit_refresh = now;
+        }
+        this_thread::sleep_for(chrono::microseconds(kAggregatorIdleUsecs));
+        continue;
+      }
+      if(request.module.empty()){
+        break;
+      }
+      SymbolResult result;
+      result.location = request.location;
+      if(request.jit_pid > 0 && resolve_jit(request, result.symbol)){
+        result.module = "[jit]";
+      } else {
+        result.symbol = resolve(request.module, request.addr);
+        result.module = move(request.module);
+      }
+      while(!results_.push(result)){
+        this_thread::yield();
+      }
+    }
+    addr2lines_.clear();
+  }
+
+  /*
+   * Results are cached, since forked processes share most of their images.
+   */
+  sym::symbol_t resolve(const string& module, uintptr_t addr){
+    auto key = make_pair(module, addr);
+    auto cache_iter = cache_.find(key);
+    if(cache_iter != end(cache_)){
+      return cache_iter->second;
+    }
+    auto& addr2line = addr2lines_[module];
+    if(!addr2line){
+      addr2line.reset(new sym::Addr2line(module));
+    }
+    auto symbol = addr2line->resolve(addr);
+    if(max_cache_ > 0 && cache_.size() >= max_cache_){
+      cache_.clear();
+    }
+    cache_[key] = symbol;
+    return symbol;
+  }
+
+  /*
+   * JIT code is not in the cache, but the aggregator keeps the name of every
+   * address it asked for. The runtime may put other code at the same address
+   * later on, so every time one does, jit_generation_ is bumped, for the
+   * aggregator to ask again.
+   */
+  bool resolve_jit(const SymbolRequest& request, sym::symbol_t& symbol){
+    auto& jit_symbols = jit_symbols_[request.jit_pid];
+    if(!jit_symbols){
+      jit_symbols.reset(new jit::JitSymbols(request.jit_pid, request.jitdump));
+    }
+    auto generation = jit_symbols->generation();
+    auto resolved = jit_symbols->resolve(request.addr, symbol);
+    if(jit_symbols->generation() != generation){
+      ++jit_generation_;
+    }
+    return resolved;
+  }
+
+  void refresh_jit(jit::JitSymbols& jit_symbols){
+    auto generation = jit_symbols.generation();
+    jit_symbols.refresh();
+    if(jit_symbols.generation() != generation){
+      ++jit_generation_;
+    }
+  }
+
+  SpscQueue<SymbolRequest> requests_;
+  SpscQueue<SymbolResult> results_;
+  map<string, unique_ptr<sym::Addr2line>> addr2lines_;
+  map<int, unique_ptr<jit::JitSymbols>> jit_symbols_; // by process
+  atomic<unsigned> jit_generation_{0}; // JIT code replaced or moved, anywhere
+  map<pair<string, uintptr_t>, sym::symbol_t> cache_;
+  size_t max_cache_;
 };
 
 
+/*
+ * Builds the profiles out of the records of the sampler: models the energy of
+ * every core and hands it out to the samples taken there. Runs on a thread of
+ * its own, so that the tracees only ever wait for the sampler.
+ *
+ * Every distinct address sampled in an image is a location. Samples of a
+ * location are staged per core until the symbolizer names its function and
+ * source line, and from then on go straight to the line's entry in the image's
+ * profile. Function profiles are the sums over their lines.
+ * Samples taken inside of a system call are locations of their own, named
+ * "caller > syscall", so that the kernel's share of the energy shows up
+ * under the function that made the call.
+ *
+ * Blocked threads get no energy, only time; their samples are "caller >
+ * syscall" too, or, if we could not tell where the call was made from, a
+ * "blocked in" pseudo function. The energy of core slices in which no traced
+ * thread was running goes to "idle" or "other processes" buckets, depending
+ * on how busy the core was, so that all of the measured energy ends up in the
+ * profile.
+ *
+ * With a memory budget, per-core tables hold at most max_entries lines; the
+ * coldest are spilled into a coarse bucket for their module. Images also
+ * only remember the max_entries hottest addresses, the others are symbolized
+ * again if they show up again.
+ *
+ * Alongside the profile, the aggregator keeps a time series of power and of
+ * the functions that used it, in rows of kSeriesPeriodUsecs, and splits the
+ * run into phases wherever the power changes, with a profile for each.
+ */
+struct Aggregator{
+  /*
+   * Distinct sampled address of an image.
+   */
+  struct location_t{
+    size_t image;
+    uint64_t key; // location_key() in the image
+    long syscall; // the system call sampled in, or -1
+    int line; // index into lines_, -1 until resolved
+    unsigned long samples; // recent samples, decays with every eviction
+    map<unsigned, ProfileValue> staged; // per core, until resolved
+  };
+
+  /*
+   * A source line of a function. Pseudo functions and unknown code have no
+   * file and line 0.
+   */
+  struct line_t{
+    unsigned function; // index into function_names_
+    string file;
+    unsigned line;
+  };
+
+  /*
+   * One row of the time series: the measured energy, and the hottest
+   * functions, by series_key().
+   */
+  struct series_row_t{
+    long start; // microseconds since the start of the run
+    long duration;
+    long long core_energy, package_energy, dram_energy;
+    float sample_period; // mean, 0 with event-based sampling
+    unsigned phase;
+    vector<pair<long, float>> functions;
+  };
+
+  /*
+   * A stretch of the run with about the same power.
+   */
+  struct phase_t{
+    long start;
+    long duration;
+    long long energy; // package and DRAM
+    unordered_map<long, ProfileValue> profile; // by series_key()
+  };
+
+  /*
+   * What the aggregator knows about an image: its mappings as last sent by
+   * the sampler, and its profile.
+   */
+  struct image_profile_t{
+    int pid;
+    string exe_name;
+    vector<proc::mapping_t> mappings;
+    string jitdump; // the jitdump file the process mapped, if any
+    unordered_map<uint64_t, unsigned> locations; // location_key() -> location
+    vector<unordered_map<unsigned, ProfileValue>> core_profiles; // line -> value
+  };
+
+  Aggregator(const Model& proc_model, const Model& uncore_model,
+             const Model& dram_model, const vector<string>& counter_names,
+             int inst_counter_idx, unsigned ncores, bool event_sampling,
+             bool count_instructions, size_t max_entries)
+    : proc_model_(proc_model), uncore_model_(uncore_model),
+      dram_model_(dram_model), counter_names_(counter_names),
+      inst_counter_idx_{inst_counter_idx}, ncores_{ncores},
+      event_sampling_{event_sampling}, count_instructions_{count_instructions},
+      max_entries_{max_entries}, interval_stats_(ncores), spilled_entries_{0},
+      idle_profiles_(ncores), other_profiles_(ncores),
+      symbolizer_{max_entries}, outstanding_symbols_{0}, jit_generation_{0},
+      series_period_sum_{0}, series_ticks_{0}, series_start_{0},
+      phase_detector_{kPhaseDrift, kPhaseThreshold, kMinPhaseRows} {
+    global_stats_.counters.resize(kAllEnergyNames.size());
+    phases_.emplace_back();
+    phases_.back().start = 0;
+    phases_.back().duration = 0;
+    phases_.back().energy = 0;
+    idle_line_ = pseudo_line_id("(idle)");
+    other_line_ = pseudo_line_id("(other processes)");
+  }
+
+  /*
+   * Consume records until the last one has been added, and all locations
+   * have been symbolized.
+   */
+  void run(SpscQueue<SampleRecord>& queue){
+    thread symbolizer_thread{[&]() { symbolizer_.run(); }};
+    SampleRecord record;
+    for(;;){
+      if(!queue.pop(record)){
+        this_thread::sleep_for(chrono::microseconds(kAggregatorIdleUsecs));
+        continue;
+      }
+      add(record);
+      if(record.last){
+        break;
+      }
+    }
+    close_series_row();
+    SymbolRequest stop;
+    request_symbol(stop);
+    while(outstanding_symbols_ > 0){
+      if(!collect_symbols()){
+        this_thread::sleep_for(chrono::microseconds(kAggregatorIdleUsecs));
+      }
+    }
+    fold_resolved();
+    enforce_budget();
+    symbolizer_thread.join();
+  }
+
+  void add(const SampleRecord& record){
+    for(const auto& update : record.image_updates){
+      if(update.image >= images_.size()){
+        images_.resize(update.image + 1);
+        images_[update.image].core_profiles.resize(ncores_);
+      }
+      auto& image = images_[update.image];
+      image.pid = update.pid;
+      image.exe_name = update.exe_name;
+      image.mappings = update.mappings;
+      // runtimes map their jitdump file for perf to find it, and so do we
+      stringstream jitdump_name;
+      jitdump_name << "/jit-" << update.pid << ".dump";
+      for(const auto& mapping : image.mappings){
+        if(mapping.path.size() >= jitdump_name.str().size() &&
+           mapping.path.compare(mapping.path.size() - jitdump_name.str().size(),
+                                string::npos, jitdump_name.str()) == 0){
+          image.jitdump = mapping.path;
+        }
+      }
+    }
+    for(unsigned i = 0; i < ncores_; ++i){
+      interval_stats_[i] += record.core_stats[i];
+    }
+    if(record.sample_period > 0){
+      series_period_sum_ += record.sample_period;
+      series_ticks_++;
+    }
+    vector<bool> core_running(ncores_, false);
+    for(const auto& sample : record.samples){
+      if(sample.blocked){
+        // only time: the energy of the core goes to what ran on it. Like a
+        // sample stopped in a system call, it is "<caller> > <syscall>",
+        // unless we could not tell where the call was made from.
+        auto time = record.core_stats[sample.core].time;
+        if(sample.rip == nullptr){
+          auto line = blocked_line_id(sample.syscall);
+          images_[sample.image].core_profiles[sample.core][line].add_sample(time);
+          interval_values_[lines_[line].function].add_sample(time);
+          continue;
+        }
+        long series_key;
+        auto& profile = profile_entry(sample.image, sample.core, sample.rip,
+                                      sample.syscall, series_key);
+        profile.add_sample(time);
+        interval_values_[series_key].add_sample(time);
+        continue;
+      }
+      core_running[sample.core] = true;
+      PendingSample pending;
+      auto& profile = profile_entry(sample.image, sample.core, sample.rip,
+                                    sample.syscall, pending.series_key);
+      pending.profile = &profile;
+      pending.core = sample.core;
+      pending.instructions = 0;
+      if(event_sampling_){
+        // every sample stands for a bucket of events of one thread
+        pending.time = sample.time;
+        if(count_instructions_){
+          pending.instructions = sample.events;
+        }
+        pending.weight = sample.events;
+      } else {
+        // every sample stands for the slice of its core since the last tick
+        const auto& slice = record.core_stats[sample.core];
+        pending.time = slice.time;
+        pending.instructions = slice.counters[inst_counter_idx_];
+        pending.weight = slice.counters[inst_counter_idx_];
+      }
+      profile.add_sample(pending.time);
+      profile.instructions += pending.instructions;
+      pending_samples_.push_back(pending);
+    }
+    // The energy of cores that none of our threads ran on
+    for(unsigned i = 0; i < ncores_; ++i){
+      if(core_running[i]){
+        continue;
+      }
+      const auto& slice = record.core_stats[i];
+      auto instructions = slice.counters.empty() ? 0 : slice.counters[inst_counter_idx_];
+      auto idle = instructions < kIdleInstructionsPerUsec * slice.time;
+      auto& profile = idle ? idle_profiles_[i] : other_profiles_[i];
+      profile.add_sample(slice.time);
+      PendingSample pending;
+      pending.profile = &profile;
+      pending.core = i;
+      pending.weight = instructions;
+      pending.series_key = lines_[idle ? idle_line_ : other_line_].function;
+      pending.time = slice.time;
+      pending.instructions = 0;
+      pending_samples_.push_back(pending);
+    }
+    if(record.read_energy){
+      attribute_interval(record.energy);
+      // no pending sample points to a staged value (or any other) anymore
+      collect_symbols();
+      fold_resolved();
+      forget_stale_jit();
+      enforce_budget();
+    }
+  }
+
+  /*
+   * User space addresses take up the lower 47 bits, which leaves the upper
+   * ones for the system call a sample was taken in.
+   */
+  static uint64_t location_key(void* rip, long syscall){
+    return (uint64_t)rip | (uint64_t)(syscall + 1) << 48;
+  }
+
+  /*
+   * Find the value a sample of an address (in a system call, or -1) on a
+   * core adds to, and the key of its function in the time series. New
+   * locations are sent off to be symbolized.
+   */
+  ProfileValue& profile_entry(size_t image_idx, unsigned core, void* rip,
+                              long syscall, long& series_key){
+    auto& image = images_[image_idx];
+    auto key = location_key(rip, syscall);
+    auto location_iter = image.locations.find(key);
+    if(location_iter == end(image.locations)){
+      unsigned location_idx = locations_.size();
+      if(free_locations_.empty()){
+        locations_.emplace_back();
+      } else {
+        location_idx = free_locations_.back();
+        free_locations_.pop_back();
+      }
+      location_iter = image.locations.emplace(key, location_idx).first;
+      auto& location = locations_[location_idx];
+      location.image = image_idx;
+      location.key = key;
+      location.syscall = syscall;
+      location.line = -1;
+      location.samples = 0;
+      SymbolRequest request;
+      request.location = location_iter->second;
+      auto addr = (uintptr_t)rip;
+      auto mapping = proc::find_mapping(image.mappings, addr);
+      request.jit_pid = 0;
+      if(mapping){
+        request.module = mapping->path;
+        request.addr = proc::module_address(*mapping, addr);
+      } else {
+        // anonymous memory, most likely JIT code
+        request.module = image.exe_name;
+        request.addr = addr;
+        request.jit_pid = image.pid;
+        request.jitdump = image.jitdump;
+      }
+      request_symbol(request);
+      ++outstanding_symbols_;
+    }
+    auto& location = locations_[location_iter->second];
+    location.samples++;
+    series_key = this->series_key(location_iter->second);
+    if(location.line < 0){
+      return location.staged[core];
+    }
+    return image.core_profiles[core][location.line];
+  }
+
+  /*
+   * The time series and phase profiles are by function. Until its function
+   * is known, a location stands in for it with a negative key.
+   */
+  long series_key(unsigned location_idx) const {
+    const auto& location = locations_[location_idx];
+    if(location.line < 0){
+      return -(long)location_idx - 1;
+    }
+    return lines_[location.line].function;
+  }
+
+  void request_symbol(SymbolRequest& request){
+    // keep taking results, or the symbolizer may wait for us as we wait for it
+    while(!symbolizer_.requests_.push(request)){
+      if(!collect_symbols()){
+        this_thread::yield();
+      }
+    }
+  }
+
+  /*
+   * Name the locations the symbolizer has resolved so far. Returns false if
+   * there were none.
+   */
+  bool collect_symbols(){
+    bool collected = false;
+    SymbolResult result;
+    while(symbolizer_.results_.pop(result)){
+      auto& location = locations_[result.location];
+      if(location.syscall >= 0){
+        result.symbol.name += " > " + sys::syscall_name(location.syscall);
+      }
+      location.line = line_id(result.symbol, result.module);
+      if(result.module == "[jit]"){
+        jit_locations_.push_back(result.location);
+      }
+      resolved_.push_back(result.location);
+      --outstanding_symbols_;
+      collected = true;
+    }
+    return collected;
+  }
+
+  unsigned function_id(const string& name){
+    auto function_iter = function_ids_.find(name);
+    if(function_iter != end(function_ids_)){
+      return function_iter->second;
+    }
+    unsigned id = function_names_.size();
+    function_ids_.emplace(name, id);
+    function_names_.push_back(name);
+    return id;
+  }
+
+  /*
+   * Index of the source line of a symbol in lines_, which also knows the
+   * coarse bucket of the symbol's module.
+   */
+  unsigned line_id(const sym::symbol_t& symbol, const string& module){
+    stringstream key;
+    key << symbol.name << '\0' << symbol.file << ':' << symbol.line;
+    auto line_iter = line_ids_.find(key.str());
+    if(line_iter != end(line_ids_)){
+      return line_iter->second;
+    }
+    unsigned id = lines_.size();
+    line_ids_.emplace(key.str(), id);
+    line_t line;
+    line.function = function_id(symbol.name);
+    line.file = symbol.file;
+    line.line = symbol.line;
+    lines_.push_back(line);
+    coarse_lines_.push_back(id);
+    sym::symbol_t bucket;
+    bucket.name = "(cold code) in " + module.substr(module.find_last_of('/') + 1);
+    bucket.line = 0;
+    if(symbol.name != bucket.name){
+      auto bucket_id = line_id(bucket, module);
+      coarse_lines_[id] = bucket_id;
+    }
+    return id;
+  }
+
+  /*
+   * Index of the line of a function that stands for something other than
+   * code, which is never spilled.
+   */
+  unsigned pseudo_line_id(const string& name){
+    sym::symbol_t symbol;
+    symbol.name = name;
+    symbol.line = 0;
+    auto id = line_id(symbol, name);
+    coarse_lines_[id] = id;
+    return id;
+  }
+
+  unsigned blocked_line_id(long syscall){
+    auto line_iter = blocked_lines_.find(syscall);
+    if(line_iter != end(blocked_lines_)){
+      return line_iter->second;
+    }
+    stringstream name;
+    if(syscall < 0){
+      name << "(blocked)";
+    } else {
+      name << "(blocked in " << sys::syscall_name(syscall) << ")";
+    }
+    auto line = pseudo_line_id(name.str());
+    blocked_lines_[syscall] = line;
+    return line;
+  }
+
+  bool is_coarse(unsigned line) const {
+    return coarse_lines_[line] == line;
+  }
+
+  /*
+   * Move what was staged for newly resolved locations into their lines.
+   * Only safe while no pending sample refers to a staged value.
+   */
+  void fold_resolved(){
+    for(auto location_idx : resolved_){
+      auto& location = locations_[location_idx];
+      auto& image = images_[location.image];
+      for(const auto& staged : location.staged){
+        image.core_profiles[staged.first][location.line] += staged.second;
+      }
+      location.staged.clear();
+      rekey_series(-(long)location_idx - 1, series_key(location_idx));
+    }
+    resolved_.clear();
+  }
+
+  /*
+   * Once a runtime replaced or moved code, the locations of JIT code may be
+   * named after what used to be there. Forget them, to be symbolized again if
+   * they are sampled again; what they were sampled for so far stays with the
+   * names they had. Only safe while no location has staged values.
+   */
+  void forget_stale_jit(){
+    auto generation = symbolizer_.jit_generation_.load();
+    if(generation == jit_generation_){
+      return;
+    }
+    jit_generation_ = generation;
+    for(auto location_idx : jit_locations_){
+      auto& location = locations_[location_idx];
+      auto& locations = images_[location.image].locations;
+      auto location_iter = locations.find(location.key);
+      // unless it was evicted since, and maybe reused
+      if(location_iter != end(locations) &&
+         location_iter->second == location_idx && location.line >= 0){
+        locations.erase(location_iter);
+        free_locations_.push_back(location_idx);
+      }
+    }
+    jit_locations_.clear();
+  }
+
+  /*
+   * Move the time series values of a newly resolved location to its function.
+   */
+  void rekey_series(long from, long to){
+    auto move_value = [&](unordered_map<long, ProfileValue>& values) {
+      auto value_iter = values.find(from);
+      if(value_iter != end(values)){
+        values[to] += value_iter->second;
+        values.erase(from);
+      }
+    };
+    move_value(series_values_);
+    for(auto& phase : phases_){
+      move_value(phase.profile);
+    }
+    auto rows_iter = unresolved_rows_.find(from);
+    if(rows_iter != end(unresolved_rows_)){
+      for(auto row : rows_iter->second){
+        for(auto& function : series_[row].functions){
+          if(function.first == from){
+            function.first = to;
+          }
+        }
+      }
+      unresolved_rows_.erase(rows_iter);
+    }
+  }
+
+  /*
+   * Hand out the energy of the RAPL interval that just ended to the IP
+   * samples that fell in it. The modeled energy of each core is distributed
+   * over the samples taken on that core, weighted by how busy the core was in
+   * each sample's slice of the interval.
+   */
+  void attribute_interval(const stats_t& energy){
+    global_stats_ += energy;
+    print("p: %lld\n", energy.counters[0]);
+    print("u: %lld\n", energy.counters[1]);
+    print("m: %lld\n", energy.counters[2]);
+
+    // global counter 0 is processor plane energy
+    auto proc_energies = modelPerCoreEnergies(
+      proc_model_, interval_stats_, counter_names_, energy.counters[0]);
+
+    // global counter 1 is package energy, including the processor plane
+    // (which we have to remove to calcluate uncore energy
+    auto uncore_energies = modelPerCoreEnergies(
+      uncore_model_, interval_stats_, counter_names_, energy.counters[1] - energy.counters[0]);
+    // global counter 2 is DRAM energy
+    auto dram_energies = modelPerCoreEnergies(
+      dram_model_, interval_stats_, counter_names_, energy.counters[2]);
+
+    // With cycle-based sampling, instruction counts are only known per core
+    auto share_instructions = event_sampling_ && !count_instructions_;
+    vector<double> core_weights(ncores_, 0.0);
+    vector<unsigned> core_samples(ncores_, 0);
+    for(const auto& sample : pending_samples_){
+      core_weights[sample.core] += sample.weight;
+      core_samples[sample.core]++;
+    }
+    for(const auto& sample : pending_samples_){
+      auto core = sample.core;
+      auto share = core_weights[core] > 0 ? sample.weight / core_weights[core]
+                                          : 1.0 / core_samples[core];
+      ProfileValue value;
+      value.processor_energy = proc_energies[core] * share;
+      value.uncore_energy = uncore_energies[core] * share;
+      value.dram_energy = dram_energies[core] * share;
+      if(share_instructions){
+        value.instructions = interval_stats_[core].counters[inst_counter_idx_] * share;
+      }
+      value.processor_energy_sq = value.processor_energy * value.processor_energy;
+      value.uncore_energy_sq = value.uncore_energy * value.uncore_energy;
+      value.dram_energy_sq = value.dram_energy * value.dram_energy;
+      auto energy = value.processor_energy + value.uncore_energy + value.dram_energy;
+      value.energy_sq = energy * energy;
+      *sample.profile += value;
+      value.add_sample(sample.time);
+      value.instructions += sample.instructions;
+      interval_values_[sample.series_key] += value;
+    }
+    pending_samples_.clear();
+    interval_stats_.assign(ncores_, stats_t());
+    add_to_series(energy);
+  }
+
+  void add_to_series(const stats_t& energy){
+    series_energy_ += energy;
+    for(const auto& value : interval_values_){
+      series_values_[value.first] += value.second;
+    }
+    interval_values_.clear();
+    if(series_energy_.time >= kSeriesPeriodUsecs){
+      close_series_row();
+    }
+  }
+
+  /*
+   * Turn what was added to the time series since the last row into a row,
+   * and into the profile of its phase.
+   */
+  void close_series_row(){
+    if(series_energy_.time == 0){
+      return;
+    }
+    series_row_t row;
+    row.start = series_start_;
+    row.duration = series_energy_.time;
+    row.core_energy = series_energy_.counters[0];
+    row.package_energy = series_energy_.counters[1];
+    row.dram_energy = series_energy_.counters[2];
+    row.sample_period = series_ticks_ > 0 ? series_period_sum_ / (float)series_ticks_ : 0;
+    auto energy = row.package_energy + row.dram_energy;
+    if(phase_detector_.add(energy / (double)row.duration)){
+      phases_.emplace_back();
+      phases_.back().start = row.start;
+      phases_.back().duration = 0;
+      phases_.back().energy = 0;
+    }
+    auto& phase = phases_.back();
+    row.phase = phases_.size() - 1;
+    phase.duration += row.duration;
+    phase.energy += energy;
+    for(const auto& value : series_values_){
+      phase.profile[value.first] += value.second;
+      const auto& v = value.second;
+      row.functions.emplace_back(value.first, v.processor_energy + v.uncore_energy + v.dram_energy);
+    }
+    auto kept = min(row.functions.size(), kSeriesRowFunctions);
+    partial_sort(begin(row.functions), begin(row.functions) + kept, end(row.functions),
+                 [](const pair<long, float>& a, const pair<long, float>& b) {
+                   return a.second > b.second;
+                 });
+    row.functions.resize(kept);
+    row.functions.shrink_to_fit();
+    for(const auto& function : row.functions){
+      if(function.first < 0){
+        unresolved_rows_[function.first].push_back(series_.size());
+      }
+    }
+    series_.push_back(move(row));
+    series_start_ += series_energy_.time;
+    series_energy_ = stats_t();
+    series_values_.clear();
+    series_period_sum_ = 0;
+    series_ticks_ = 0;
+  }
+
+  /*
+   * Bring tables that grew past the memory budget back below it, with some
+   * headroom so that this doesn't happen every interval. Only safe while no
+   * pending sample refers to a profile value.
+   */
+  void enforce_budget(){
+    if(max_entries_ == 0){
+      return;
+    }
+    auto target = max_entries_ - max_entries_ / 4;
+    for(auto& image : images_){
+      for(auto& profile : image.core_profiles){
+        if(profile.size() > max_entries_){
+          spill_lines(profile, target);
+        }
+      }
+      if(image.locations.size() > max_entries_){
+        evict_locations(image, target);
+      }
+    }
+  }
+
+  /*
+   * Merge the lines with the least energy into their module's bucket.
+   */
+  void spill_lines(unordered_map<unsigned, ProfileValue>& profile,
+                   size_t target){
+    vector<pair<double, unsigned>> candidates;
+    for(const auto& line : profile){
+      if(!is_coarse(line.first)){
+        const auto& value = line.second;
+        auto energy = value.processor_energy + value.uncore_energy + value.dram_energy;
+        candidates.emplace_back(energy > 0 ? energy : value.time, line.first);
+      }
+    }
+    auto count = min(candidates.size(), profile.size() - min(profile.size(), target));
+    nth_element(begin(candidates), begin(candidates) + count, end(candidates));
+    for(size_t i = 0; i < count; ++i){
+      auto line = candidates[i].second;
+      auto value = profile[line];
+      profile.erase(line);
+      profile[coarse_lines_[line]] += value;
+    }
+    spilled_entries_ += count;
+  }
+
+  /*
+   * Forget the least sampled addresses of an image whose lines are known.
+   * Their samples are already in the line tables.
+   */
+  void evict_locations(image_profile_t& image, size_t target){
+    vector<pair<unsigned long, unsigned>> candidates;
+    for(const auto& rip_location : image.locations){
+      auto& location = locations_[rip_location.second];
+      if(location.line >= 0){
+        candidates.emplace_back(location.samples, rip_location.second);
+      }
+      // halve old counts, so that formerly hot addresses can go eventually
+      location.samples /= 2;
+    }
+    auto count = min(candidates.size(), image.locations.size() - target);
+    nth_element(begin(candidates), begin(candidates) + count, end(candidates));
+    for(size_t i = 0; i < count; ++i){
+      auto location_idx = candidates[i].second;
+      image.locations.erase(locations_[location_idx].key);
+      free_locations_.push_back(location_idx);
+    }
+  }
+
+  const Model& proc_model_;
+  const Model& uncore_model_;
+  const Model& dram_model_;
+  vector<string> counter_names_;
+  int inst_counter_idx_;
+  unsigned ncores_;
+  bool event_sampling_;
+  bool count_instructions_;
+  size_t max_entries_; // per table, 0 for no bound
+
+  // IP samples and per-core counters since the last energy reading
+  vector<PendingSample> pending_samples_;
+  vector<stats_t> interval_stats_;
+  // Indexed like the sampler's images. Deques, since pending samples point
+  // into them while they grow.
+  deque<image_profile_t> images_;
+  deque<location_t> locations_;
+  vector<unsigned> free_locations_; // evicted, to be reused
+  vector<string> function_names_;
+  unordered_map<string, unsigned> function_ids_;
+  vector<line_t> lines_;
+  unordered_map<string, unsigned> line_ids_;
+  vector<unsigned> coarse_lines_; // coarse bucket of every line
+  unsigned long long spilled_entries_;
+  // per core, energy while no traced thread was running
+  vector<ProfileValue> idle_profiles_;
+  vector<ProfileValue> other_profiles_;
+  unsigned idle_line_, other_line_;
+  map<long, unsigned> blocked_lines_; // by system call
+  stats_t global_stats_;
+
+  Symbolizer symbolizer_;
+  size_t outstanding_symbols_; // locations sent to the symbolizer, not yet named
+  vector<unsigned> resolved_;  // named, but still have staged values
+  vector<unsigned> jit_locations_; // named after JIT code
+  unsigned jit_generation_;        // of the symbolizer, that they are named in
+
+  // by series_key(): since the last energy reading, since the last row
+  unordered_map<long, ProfileValue> interval_values_;
+  unordered_map<long, ProfileValue> series_values_;
+  stats_t series_energy_; // since the last row
+  long long series_period_sum_; // sample periods since the last row
+  long series_ticks_;
+  long series_start_;
+  vector<series_row_t> series_;
+  unordered_map<long, vector<size_t>> unresolved_rows_; // rows with a location
+  phase::ChangeDetector phase_detector_;
+  vector<phase_t> phases_;
+};
+
+/*
+ * Sum up the lines of a profile by function.
+ */
+unordered_map<unsigned, ProfileValue> function_profile(
+    const unordered_map<unsigned, ProfileValue>& line_profile,
+    const Aggregator& aggregator){
+  unordered_map<unsigned, ProfileValue> result;
+  for(const auto& line : line_profile){
+    result[aggregator.lines_[line.first].function] += line.second;
+  }
+  return result;
+}
+
+/*
+ * Turn the per-function values of a profile into named entries.
+ */
+vector<ProfileEntry> profile_entries(const unordered_map<unsigned, ProfileValue>& profile,
+                                     const vector<string>& function_names){
+  vector<ProfileEntry> result;
+  result.reserve(profile.size());
+  for(const auto& function : profile){
+    ProfileEntry entry;
+    entry.name = function_names[function.first];
+    entry.processor_energy = function.second.processor_energy;
+    entry.uncore_energy = function.second.uncore_energy;
+    entry.dram_energy = function.second.dram_energy;
+    entry.time = function.second.time;
+    entry.instructions = function.second.instructions;
+    entry.samples = function.second.samples;
+    entry.processor_energy_ci = kConfidenceZ * sqrt(function.second.processor_energy_sq);
+    entry.uncore_energy_ci = kConfidenceZ * sqrt(function.second.uncore_energy_sq);
+    entry.dram_energy_ci = kConfidenceZ * sqrt(function.second.dram_energy_sq);
+    entry.energy_ci = kConfidenceZ * sqrt(function.second.energy_sq);
+    entry.time_ci = kConfidenceZ * sqrt(function.second.time_sq);
+    result.push_back(entry);
+  }
+  return result;
+}
+
+/*
+ * Whether we can tell the energy of an entry (or its time, if it has no
+ * energy) to within the maximum relative error.
+ */
+bool is_significant(const ProfileEntry& entry, double max_error){
+  auto energy = entry.processor_energy + entry.uncore_energy + entry.dram_energy;
+  if(energy > 0){
+    return entry.energy_ci <= max_error * energy;
+  }
+  return entry.time_ci <= max_error * entry.time;
+}
+
+/*
+ * Write a profile, hottest first. Entries that are not significant are
+ * flagged, or with drop_insignificant, merged into a single entry so that
+ * the totals stay the same.
+ */
+void write_profile(const string& fname, vector<ProfileEntry>& profile,
+                   double max_error, bool drop_insignificant){
+  if(drop_insignificant){
+    ProfileEntry dropped = ProfileEntry();
+    dropped.name = "(insignificant entries)";
+    auto kept = partition(begin(profile), end(profile),
+                          [&](const ProfileEntry& entry) {
+                            return is_significant(entry, max_error);
+                          });
+    // independent entries: variances add up
+    auto add_ci = [](double& ci, double other) { ci = sqrt(ci * ci + other * other); };
+    for(auto iter = kept; iter != end(profile); ++iter){
+      dropped.processor_energy += iter->processor_energy;
+      dropped.uncore_energy += iter->uncore_energy;
+      dropped.dram_energy += iter->dram_energy;
+      dropped.time += iter->time;
+      dropped.instructions += iter->instructions;
+      dropped.samples += iter->samples;
+      add_ci(dropped.processor_energy_ci, iter->processor_energy_ci);
+      add_ci(dropped.uncore_energy_ci, iter->uncore_energy_ci);
+      add_ci(dropped.dram_energy_ci, iter->dram_energy_ci);
+      add_ci(dropped.energy_ci, iter->energy_ci);
+      add_ci(dropped.time_ci, iter->time_ci);
+    }
+    if(kept != end(profile)){
+      profile.erase(kept, end(profile));
+      profile.push_back(dropped);
+    }
+  }
+  sort(begin(profile), end(profile),
+       [&](const ProfileEntry& a, const ProfileEntry& b) {
+         auto a_energy = a.processor_energy + a.uncore_energy + a.dram_energy;
+         auto b_energy = b.processor_energy + b.uncore_energy + b.dram_energy;
+         return a_energy > b_energy;
+       });
+  ofstream outfile{fname};
+  outfile << "Name\tProcessor Energy\tUncore Energy\tDRAM Energy\tTime\tInstructions"
+          << "\tSamples\tProcessor Energy CI\tUncore Energy CI\tDRAM Energy CI\tTime CI"
+          << "\tSignificant\n";
+  for(const auto& elem : profile){
+    outfile << elem.name << "\t"
+            << elem.processor_energy / kNanoToBase << "\t"
+            << elem.uncore_energy / kNanoToBase << "\t"
+            << elem.dram_energy / kNanoToBase << "\t"
+            << elem.time / kMicroToBase << "\t"
+            << elem.instructions << "\t"
+            << elem.samples << "\t"
+            << elem.processor_energy_ci / kNanoToBase << "\t"
+            << elem.uncore_energy_ci / kNanoToBase << "\t"
+            << elem.dram_energy_ci / kNanoToBase << "\t"
+            << elem.time_ci / kMicroToBase << "\t"
+            << (is_significant(elem, max_error) ? "yes" : "no") << "\n";
+  }
+}
+
+double total_energy(const ProfileValue& value){
+  return value.processor_energy + value.uncore_energy + value.dram_energy;
+}
+
+/*
+ * Write a per-line profile: every sampled source line with its function,
+ * hottest first.
+ */
+void write_line_profile(const string& fname,
+                        const unordered_map<unsigned, ProfileValue>& profile,
+                        const Aggregator& aggregator){
+  vector<pair<unsigned, ProfileValue>> lines(begin(profile), end(profile));
+  sort(begin(lines), end(lines),
+       [](const pair<unsigned, ProfileValue>& a, const pair<unsigned, ProfileValue>& b) {
+         return total_energy(a.second) > total_energy(b.second);
+       });
+  ofstream outfile{fname};
+  outfile << "Function\tFile\tLine\tProcessor Energy\tUncore Energy\tDRAM Energy\tTime\tInstructions\tSamples\n";
+  for(const auto& elem : lines){
+    const auto& line = aggregator.lines_[elem.first];
+    const auto& value = elem.second;
+    outfile << aggregator.function_names_[line.function] << "\t"
+            << (line.file.empty() ? "??" : line.file) << "\t"
+            << line.line << "\t"
+            << value.processor_energy / kNanoToBase << "\t"
+            << value.uncore_energy / kNanoToBase << "\t"
+            << value.dram_energy / kNanoToBase << "\t"
+            << value.time / kMicroToBase << "\t"
+            << value.instructions << "\t"
+            << value.samples << "\n";
+  }
+}
+
+/*
+ * Write the time series of power, in watts, one row per line: the measured
+ * power, and the power of the hottest functions of the run.
+ */
+void write_series(const string& fname, const Aggregator& aggregator){
+  unordered_map<long, double> function_energies;
+  for(const auto& phase : aggregator.phases_){
+    for(const auto& function : phase.profile){
+      function_energies[function.first] += total_energy(function.second);
+    }
+  }
+  vector<pair<double, long>> hottest;
+  for(const auto& function : function_energies){
+    hottest.emplace_back(function.second, function.first);
+  }
+  auto columns = min(hottest.size(), kSeriesFunctions);
+  partial_sort(begin(hottest), begin(hottest) + columns, end(hottest),
+               [](const pair<double, long>& a, const pair<double, long>& b) {
+                 return a.first > b.first;
+               });
+  hottest.resize(columns);
+
+  ofstream outfile{fname};
+  outfile << "Start\tDuration\tSample Period\tPhase\tPackage Power\tCore Power\tUncore Power\tDRAM Power";
+  for(const auto& function : hottest){
+    outfile << "\t" << aggregator.function_names_[function.second];
+  }
+  outfile << "\tOther Functions\n";
+  outfile << setprecision(4);
+  for(const auto& row : aggregator.series_){
+    auto seconds = row.duration / (double)kMicroToBase;
+    auto watts = [&](double energy) { return energy / kNanoToBase / seconds; };
+    outfile << row.start / (double)kMicroToBase << "\t" << seconds << "\t"
+            << row.sample_period << "\t" << row.phase << "\t"
+            << watts(row.package_energy) << "\t"
+            << watts(row.core_energy) << "\t"
+            << watts(row.package_energy - row.core_energy) << "\t"
+            << watts(row.dram_energy);
+    double shown = 0;
+    for(const auto& function : hottest){
+      double energy = 0;
+      for(const auto& entry : row.functions){
+        if(entry.first == function.second){
+          energy += entry.second;
+        }
+      }
+      shown += energy;
+      outfile << "\t" << watts(energy);
+    }
+    outfile << "\t" << max(0.0, watts(row.package_energy + row.dram_energy - shown)) << "\n";
+  }
+}
+
+/*
+ * Write the sampled parts of every source file we can still read, hottest
+ * file first, with the energy of each line in front of it.
+ */
+void write_annotated_source(const string& fname,
+                            const unordered_map<unsigned, ProfileValue>& profile,
+                            const Aggregator& aggregator){
+  // file -> line number -> energy
+  map<string, map<unsigned, double>> files;
+  for(const auto& elem : profile){
+    const auto& line = aggregator.lines_[elem.first];
+    if(!line.file.empty() && line.line > 0){
+      files[line.file][line.line] += total_energy(elem.second);
+    }
+  }
+  vector<pair<double, string>> hottest;
+  for(const auto& file : files){
+    double energy = 0;
+    for(const auto& line : file.second){
+      energy += line.second;
+    }
+    hottest.emplace_back(energy, file.first);
+  }
+  sort(begin(hottest), end(hottest),
+       [](const pair<double, string>& a, const pair<double, string>& b) {
+         return a.first > b.first;
+       });
+
+  ofstream outfile{fname};
+  outfile << fixed << setprecision(6);
+  for(const auto& file : hottest){
+    ifstream source{file.second};
+    if(!source){
+      continue;
+    }
+    const auto& energies = files[file.second];
+    outfile << "==> " << file.second << "\t" << file.first / kNanoToBase << " joules\n";
+    string text;
+    unsigned number = 0, last_printed = 0;
+    while(getline(source, text)){
+      ++number;
+      // print lines near a sampled one
+      auto near = energies.lower_bound(number > kAnnotateContext ? number - kAnnotateContext : 0);
+      if(near == end(energies) || near->first > number + kAnnotateContext){
+        continue;
+      }
+      if(last_printed > 0 && number > last_printed + 1){
+        outfile << "...\n";
+      }
+      auto energy_iter = energies.find(number);
+      if(energy_iter != end(energies)){
+        outfile << setw(12) << energy_iter->second / kNanoToBase;
+      } else {
+        outfile << setw(12) << "";
+      }
+      outfile << "  " << setw(6) << number << "  " << text << "\n";
+      last_printed = number;
+    }
+    outfile << "\n";
+  }
+}
+
+
 void do_profiling(int profilee_pid, const char* profilee_name,
-                  const long period, const char* prefix,
+                  long period, const long energy_period,
+                  const uint64_t event_period, const uint64_t event_config,
+                  const double max_overhead, const long min_period,
+                  const long max_period, const double max_error,
+                  const bool drop_insignificant,
+                  const size_t max_entries, const char* prefix,
                   const Model& proc_model, const Model& uncore_model, const Model& dram_model) {
   /*
    * Structures holding profiling data
    */
-  vector<int> children_pids;
-  vector<map<void*, ProfileValue>> core_profiles;
-  stats_t global_stats;
-  global_stats.counters.resize(3);
+  // Registry of all threads we trace, keyed by thread ID. Every clone, exit
+  // and sample looks threads up here, so it has to stay O(1) with thousands
+  // of threads.
+  unordered_map<int, ThreadInfo> threads;
+  // every image we have seen, and the current image of each live process
+  vector<ProcessImage> images;
+  map<int, size_t> live_images;
   vector<event_info_t> core_counters;
+  vector<vector<long long>> core_last_values;
+  vector<long long> global_last_values;
+  StopWindowStats stop_windows;
   // TODO: assumption here is that hyperthreading is turned on, and that there
-  // are two hardware threads per physical core. We have to make sure we only 
+  // are two hardware threads per physical core. We have to make sure we only
   // run the correct number of threads during auditing, since this assumption
   // is made.
   auto ncores = thread::hardware_concurrency() / 2;
   //auto ncores = 1u;
-  core_profiles.resize(ncores);
   core_counters.reserve(ncores);
+  core_last_values.resize(ncores);
+  // read energy every few IP samples
+  long samples_per_interval = max(1l, (energy_period + period / 2) / period);
+  long samples_in_interval = 0;
+  // time spent sampling, in total and since the period was last adjusted
+  long long sampling_nsecs = 0, window_sampling_nsecs = 0;
+  vector<PeriodChange> period_changes;
 
   /*
    * Initialize PAPI
@@ -369,10 +1741,287 @@ void do_profiling(int profilee_pid, const char* profilee_name,
   auto global_counters = init_papi_counters(kAllEnergyNames);
   start_counters(global_counters);
 
+  /*
+   * Start the aggregator. The sampler (this thread) only reads counters and
+   * registers and passes them on, one record per timer tick.
+   */
+  Aggregator aggregator{proc_model, uncore_model, dram_model, counter_names,
+                        inst_counter_idx, ncores, event_period > 0,
+                        event_config == PERF_COUNT_HW_INSTRUCTIONS, max_entries};
+  SpscQueue<SampleRecord> queue{kRecordQueueLength};
+  // The timer signal has to interrupt our waits for the tracees, so keep the
+  // aggregator thread from taking it.
+  sigset_t timer_signal, old_mask;
+  sigemptyset(&timer_signal);
+  sigaddset(&timer_signal, SIGALRM);
+  pthread_sigmask(SIG_BLOCK, &timer_signal, &old_mask);
+  thread worker{[&]() { aggregator.run(queue); }};
+  pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+
+  SampleRecord record;
+  record.core_stats.resize(ncores);
+  long long queue_full_waits = 0;
+  auto send_record = [&]() {
+    while(!queue.push(record)){
+      ++queue_full_waits;
+      this_thread::yield();
+    }
+    record = SampleRecord();
+    record.core_stats.resize(ncores);
+  };
+  long long last_sample_time = 0;
+  auto read_core_stats = [&]() {
+    auto sample_time = PAPI_get_real_usec();
+    for(unsigned int i = 0; i < ncores; ++i){
+      record.core_stats[i] += read_rapl(core_counters[i], core_last_values[i],
+                                        sample_time - last_sample_time);
+    }
+    last_sample_time = sample_time;
+  };
+  long long last_interval_time = 0;
+  auto read_energy = [&]() {
+    auto interval_time = PAPI_get_real_usec();
+    record.energy = read_rapl(global_counters, global_last_values,
+                              interval_time - last_interval_time);
+    record.read_energy = true;
+    last_interval_time = interval_time;
+  };
+
   /*
    * Setup tracing of all profilee threads
    */
-  children_pids.push_back(profilee_pid);
+  threads.emplace(profilee_pid, ThreadInfo(profilee_pid));
+
+  // let the aggregator know about a new image, or new mappings of one
+  auto send_image = [&](size_t image_idx) {
+    ImageUpdate update;
+    update.image = image_idx;
+    update.pid = images[image_idx].pid;
+    update.exe_name = images[image_idx].exe_name;
+    update.mappings = images[image_idx].mappings;
+    record.image_updates.push_back(move(update));
+  };
+
+  /*
+   * Find the image an address was sampled in, in the given process. Addresses
+   * in no mapping we know of are noted for refresh_images() to look up, which
+   * is not worth keeping the threads stopped for.
+   */
+  vector<size_t> stale_images;
+  auto sample_image = [&](int tgid, void* rip) -> size_t {
+    auto image_idx = live_images[tgid];
+    auto& image = images[image_idx];
+    auto addr = (uintptr_t)rip;
+    if(!proc::find_mapping(image.mappings, addr) &&
+       !proc::find_mapping(image.anonymous, addr) &&
+       image.unmapped.count(addr) == 0){
+      if(image.unknown.empty()){
+        stale_images.push_back(image_idx);
+      }
+      image.unknown.push_back(addr);
+    }
+    return image_idx;
+  };
+
+  /*
+   * Reread the mappings of the images addresses were sampled in that we did
+   * not know about, once per image, while their processes are still around to
+   * ask, and let the aggregator know if there were new ones before it gets
+   * the samples.
+   */
+  auto refresh_images = [&]() {
+    for(auto image_idx : stale_images){
+      auto& image = images[image_idx];
+      image.anonymous.clear();
+      auto fresh = proc::read_mappings(image.pid, &image.anonymous);
+      if(proc::merge_mappings(image.mappings, fresh)){
+        send_image(image_idx);
+      }
+      for(auto addr : image.unknown){
+        if(!proc::find_mapping(image.mappings, addr) &&
+           !proc::find_mapping(image.anonymous, addr)){
+          if(image.unmapped.size() >= kMaxUnmappedAddresses){
+            image.unmapped.clear();
+          }
+          image.unmapped.insert(addr);
+        }
+      }
+      image.unknown.clear();
+    }
+    stale_images.clear();
+  };
+
+  /*
+   * Event-based sampling: every sample stands for a bucket of event_period
+   * instructions (or cycles) that one thread executed. Buckets get an equal
+   * share of the energy of their core, and the time the thread spent on the
+   * CPU since its previous sample.
+   */
+  uint64_t lost_samples = 0;
+  auto drain_thread = [&](ThreadInfo& info) {
+    lost_samples += perf::drain_samples(info.sampler, [&](const perf::sample_t& sample) {
+      auto time_running = sample.time_running - info.last_time_running;
+      info.last_time_running = sample.time_running;
+      info.core = sample.cpu;
+      // Same hack as for time-based sampling: ignore second hardware threads
+      if(sample.cpu >= ncores) { return; }
+      IpSample ip_sample = IpSample();
+      ip_sample.image = sample_image(info.tgid, (void*)sample.ip);
+      ip_sample.core = sample.cpu;
+      ip_sample.rip = (void*)sample.ip;
+      ip_sample.events = sample.period;
+      ip_sample.time = time_running / (double)(kNanoToBase / kMicroToBase);
+      ip_sample.syscall = -1; // user mode events only
+      record.samples.push_back(ip_sample);
+    });
+  };
+  auto start_sampling = [&](int tid) {
+    if(event_period > 0){
+      threads.at(tid).sampler = perf::open_sampler(tid, event_config, event_period);
+    }
+  };
+
+  auto erase_thread = [&](int tid) -> bool {
+    auto thread_iter = threads.find(tid);
+    if(thread_iter == end(threads)){
+      return false;
+    }
+    if(thread_iter->second.stat_fd != -1){
+      close(thread_iter->second.stat_fd);
+    }
+    if(thread_iter->second.syscall_fd != -1){
+      close(thread_iter->second.syscall_fd);
+    }
+    drain_thread(thread_iter->second);
+    refresh_images();
+    perf::close_sampler(thread_iter->second.sampler);
+    threads.erase(thread_iter);
+    return true;
+  };
+  /*
+   * Read one of a thread's /proc files with the given reader. The file is
+   * opened on first use and kept open in cached_fd.
+   */
+  auto read_task_file = [&](int tid, int& cached_fd, const char* file,
+                            function<bool(int)> reader) -> bool {
+    auto tgid = threads.at(tid).tgid;
+    if(cached_fd == -1){
+      cached_fd = proc::open_task_file(tgid, tid, file);
+    }
+    if(cached_fd != -1){
+      return reader(cached_fd);
+    }
+    // out of descriptors, fall back to opening it every time
+    auto fd = proc::open_task_file(tgid, tid, file);
+    if(fd == -1){
+      return false;
+    }
+    auto result = reader(fd);
+    close(fd);
+    return result;
+  };
+  // We keep /proc files open for every thread, which quickly exceeds the
+  // default soft limit on open files.
+  struct rlimit files_limit;
+  if(getrlimit(RLIMIT_NOFILE, &files_limit) == 0){
+    files_limit.rlim_cur = files_limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files_limit);
+  }
+  auto add_image = [&](int pid, const string& exe_name) {
+    ProcessImage image;
+    image.pid = pid;
+    image.exe_name = exe_name;
+    proc::merge_mappings(image.mappings, proc::read_mappings(pid, &image.anonymous));
+    live_images[pid] = images.size();
+    images.push_back(move(image));
+    send_image(images.size() - 1);
+  };
+
+  /*
+   * Handle a stop (or exit) of a tracee that we did not ask for, and let the
+   * tracee continue. Returns false once there are no traced threads left.
+   */
+  auto handle_stop = [&](int tid, int status) -> bool {
+    if(status>>8 == (SIGTRAP | (PTRACE_EVENT_CLONE<<8)) ||
+       status>>8 == (SIGTRAP | (PTRACE_EVENT_FORK<<8)) ||
+       status>>8 == (SIGTRAP | (PTRACE_EVENT_VFORK<<8))) { // new thread or process created
+      print("New thread created.\n");
+      unsigned long new_pid;
+      ptrace(PTRACE_GETEVENTMSG, tid, nullptr, &new_pid);
+      if(threads.count(new_pid) != 0) {
+        cerr << "Already have this newly cloned pid: " << new_pid << ".\n";
+        exit(-1);
+      }
+      print("Thread ID %lu created from thread ID %d\n", new_pid, tid);
+      auto parent_tgid = threads.at(tid).tgid;
+      // clone() without CLONE_THREAD also makes a new process
+      if(status>>8 != (SIGTRAP | (PTRACE_EVENT_CLONE<<8)) ||
+         proc::read_tgid(new_pid) == (int)new_pid){
+        print("Process %lu forked from process %d\n", new_pid, parent_tgid);
+        // the child starts out as a copy of its parent's image
+        auto parent_idx = live_images[parent_tgid];
+        ProcessImage image;
+        image.pid = new_pid;
+        image.exe_name = images[parent_idx].exe_name;
+        image.mappings = images[parent_idx].mappings;
+        live_images[new_pid] = images.size();
+        images.push_back(move(image));
+        send_image(images.size() - 1);
+        threads.emplace(new_pid, ThreadInfo(new_pid));
+      } else {
+        threads.emplace(new_pid, ThreadInfo(parent_tgid));
+      }
+      start_sampling(new_pid);
+      ptrace(PTRACE_CONT, tid, nullptr, nullptr);
+      return true;
+    }
+    if(status>>8 == (SIGTRAP | (PTRACE_EVENT_EXEC<<8))) { // new program image
+      // Exec kills every other thread of the process, and those do not all
+      // report their exits. A non-leader thread calling exec takes over the
+      // leader's thread ID, and its old ID disappears without an exit event.
+      vector<int> process_tids;
+      for(const auto& thread : threads){
+        if(thread.second.tgid == tid){
+          process_tids.push_back(thread.first);
+        }
+      }
+      for(auto process_tid : process_tids){
+        erase_thread(process_tid);
+      }
+      threads.emplace(tid, ThreadInfo(tid));
+      auto exe_name = proc::read_exe(tid);
+      print("Process %d exec'd %s\n", tid, exe_name.c_str());
+      add_image(tid, exe_name);
+      start_sampling(tid);
+      ptrace(PTRACE_CONT, tid, nullptr, nullptr);
+      return true;
+    }
+    if(status>>8 == (SIGTRAP | (PTRACE_EVENT_EXIT<<8))){
+      print("Deleting child %d\n", tid);
+      if(!erase_thread(tid)){
+        cerr << "Error: Saw exit from pid " << tid << ". We haven't seen before!\n";
+        exit(-1);
+      }
+      print("%lu children left\n", threads.size());
+    }
+    if(WIFEXITED(status) || WIFSIGNALED(status)){
+      // gone without an exit event, if killed, or if another thread of its
+      // process exec'd; nothing to continue
+      print("Child %d is gone\n", tid);
+      erase_thread(tid);
+      return !threads.empty();
+    }
+    // Always let the stopped tracee continue. Signals meant for the profilee
+    // are passed on (launchers rely on SIGCHLD). Group-stops and interrupts
+    // show up as PTRACE_EVENT_STOP and carry no signal to pass on.
+    long signal = 0;
+    if(WIFSTOPPED(status) && status>>16 == 0){
+      signal = WSTOPSIG(status);
+    }
+    ptrace(PTRACE_CONT, tid, nullptr, signal);
+    // All done once we are not tracking any more threads
+    return !threads.empty();
+  };
 
   /*
    * Set up timer
@@ -385,8 +2034,39 @@ void do_profiling(int profilee_pid, const char* profilee_name,
     exit(-1);
   }
   struct itimerval work_time;
-  time_t sleep_secs = period / kMicroToBase;
-  suseconds_t sleep_usecs = period % kMicroToBase; 
+  // with event-based sampling we only wake up to read energy
+  auto timer_period = event_period > 0 ? energy_period : period;
+  time_t sleep_secs = timer_period / kMicroToBase;
+  suseconds_t sleep_usecs = timer_period % kMicroToBase;
+  long long sampling_start = 0, overhead_window_start = 0; // nanoseconds
+
+  /*
+   * With a maximum overhead, scale the sample period by how far the overhead
+   * of the last window was off the target. Only called at the end of an
+   * energy interval, so that every interval is sampled at a single period.
+   */
+  auto adjust_period = [&](long long now) {
+    auto window = now - overhead_window_start;
+    if(window < kOverheadWindowUsecs * 1000){
+      return;
+    }
+    auto overhead = window_sampling_nsecs / (double)window;
+    auto factor = min(kMaxPeriodChange, max(1 / kMaxPeriodChange, overhead / max_overhead));
+    auto new_period = min(max_period, max(min_period, (long)(period * factor)));
+    if(new_period != period){
+      period = new_period;
+      sleep_secs = period / kMicroToBase;
+      sleep_usecs = period % kMicroToBase;
+      samples_per_interval = max(1l, (energy_period + period / 2) / period);
+      PeriodChange change;
+      change.time = (now - sampling_start) / 1000;
+      change.overhead = overhead;
+      change.period = period;
+      period_changes.push_back(change);
+    }
+    overhead_window_start = now;
+    window_sampling_nsecs = 0;
+  };
   work_time.it_value.tv_sec = sleep_secs;
   work_time.it_value.tv_usec = sleep_usecs;
   work_time.it_interval.tv_sec = sleep_secs;
@@ -396,243 +2076,391 @@ void do_profiling(int profilee_pid, const char* profilee_name,
   /*
    * Let the profilee run, periodically interrupting to collect profile data.
    */
-  ptrace(PTRACE_CONT, profilee_pid, nullptr, nullptr); // Allow child to fork
+  // The profilee was seized while it waited for us in a SIGSTOP. Wake it up
+  // and let it run up to the exec of the audited program.
+  kill(profilee_pid, SIGCONT);
   int status;
-  wait(&status); // wait for child to begin executing
+  for(;;){
+    if(waitpid(profilee_pid, &status, __WALL) == -1){
+      if(errno == EINTR){
+        continue;
+      }
+      cerr << "Error: unexpected return from wait - " << strerror(errno) << "\n";
+      exit(-1);
+    }
+    if(WIFEXITED(status) || WIFSIGNALED(status)){
+      cerr << "Error: profilee exited before starting its program.\n";
+      exit(-1);
+    }
+    if(status>>8 == (SIGTRAP | (PTRACE_EVENT_EXEC<<8))){
+      break;
+    }
+    ptrace(PTRACE_CONT, profilee_pid, nullptr,
+           status>>16 == 0 ? WSTOPSIG(status) : 0);
+  }
   print("Start profiling.\n");
-  /* Reassert that we want the profilee to stop when it clones */
-  ptrace(PTRACE_SETOPTIONS, profilee_pid, nullptr,
-         PTRACE_O_EXITKILL | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXIT);
+  auto profilee_exe = proc::read_exe(profilee_pid);
+  add_image(profilee_pid, profilee_exe.empty() ? profilee_name : profilee_exe);
+  start_sampling(profilee_pid);
   ptrace(PTRACE_CONT, profilee_pid, nullptr, nullptr); // Allow child to run!
-  using core_id_t = int;
-  using assignments_left_t = int;
-  map<int, pair<core_id_t, assignments_left_t>> children_cores;
-  // We only want to match child PIDs to processors infrequently, since it 
-  // requires a filesystem read. The assumption here is that threads are bound
-  // to cores, and only get created at the beginning of the function
-  // 50 is a magic number derived by running some apps a bunch of times.
   auto start_time = PAPI_get_real_usec();
+  last_sample_time = start_time;
+  last_interval_time = start_time;
+  for(unsigned int i = 0; i < ncores; ++i){
+    read_rapl(core_counters[i], core_last_values[i], 0);
+  }
+  read_rapl(global_counters, global_last_values, 0);
+  sampling_start = PAPI_get_real_nsec();
+  overhead_window_start = sampling_start;
+  PeriodChange initial_period;
+  initial_period.time = 0;
+  initial_period.period = period;
+  initial_period.overhead = 0;
+  period_changes.push_back(initial_period);
   for (;;) {
     auto wait_res = waitpid(-1, &status, __WALL);
     if(wait_res == -1){ // bad wait!
-      if(errno == EINTR && is_timer_done){ // timer expired, do profiling
+      if(errno == EINTR && is_timer_done && event_period > 0){
+        // Event-based sampling: the kernel has already taken the samples and
+        // no thread needs to be stopped. Collect them, together with the
+        // energy of the interval.
+        for(auto& thread : threads){
+          drain_thread(thread.second);
+        }
+        refresh_images();
+        read_core_stats();
+        read_energy();
+        send_record();
+        is_timer_done = false;
+      } else if(errno == EINTR && is_timer_done){ // timer expired, do profiling
+        auto tick_start = PAPI_get_real_nsec();
         // halt timer
         work_time.it_value.tv_sec = 0;
         work_time.it_value.tv_usec = 0;
         setitimer(ITIMER_REAL, &work_time, nullptr);
-        
-        // kill all the children
-        for(const auto& child : children_pids){
-          kill(child, SIGSTOP);
+
+        // collect stats from cores for the slice since the last sample, and
+        // the energy if this sample ends an interval
+        print("EAUDIT collating stats\n");
+        read_core_stats();
+        if(++samples_in_interval == samples_per_interval){
+          read_energy();
+          samples_in_interval = 0;
         }
 
-        // find last executing core ID for each child
-        for(const auto& child : children_pids){
-          auto core_iter = children_cores.find(child);
-          if(core_iter == end(children_cores)){
-            auto& elem = children_cores[child];
-            elem.second = kTotalCoreAssignments;
-            core_iter = children_cores.find(child);
+        // Find out what each thread is doing before stopping any: where it
+        // last ran, every sample, since threads migrate, and whether it is
+        // blocked. Blocked threads are sampled through /proc instead of being
+        // stopped.
+        for(auto& thread : threads){
+          auto& child_info = thread.second;
+          proc::task_state_t state;
+          if(!read_task_file(thread.first, child_info.stat_fd, "stat",
+                             [&](int fd) { return proc::read_task_state(fd, state); })){
+            continue;
           }
-          if(core_iter->second.second > 0){
-            core_iter->second.second--;
-            stringstream proc_fname;
-            proc_fname << "/proc/" << child << "/stat";
-            ifstream procfile(proc_fname.str());
-            if(!procfile.is_open()){
-              cerr << "Error: couldn't open proc file!\n";
-              exit(-1);
+          child_info.core = state.cpu;
+          if(state.state == 'S' || state.state == 'D'){
+            child_info.blocked = read_task_file(
+              thread.first, child_info.syscall_fd, "syscall", [&](int fd) {
+                return proc::read_task_syscall(fd, child_info.syscall,
+                                               child_info.blocked_pc);
+              });
+          }
+        }
+
+        /*
+         * Stop all the running children. Interrupt all of them first and only
+         * then collect their stops, so that they come to a halt in parallel.
+         */
+        auto window_start = PAPI_get_real_nsec();
+        auto nthreads = threads.size();
+        size_t pending = 0;
+        for(auto& thread : threads){
+          if(thread.second.blocked){
+            continue;
+          }
+          if(ptrace(PTRACE_INTERRUPT, thread.first, nullptr, nullptr) == 0){
+            thread.second.interrupted = true;
+            ++pending;
+          }
+        }
+        bool tracees_left = true;
+        while(pending > 0 && tracees_left){
+          auto stop_res = waitpid(-1, &status, __WALL);
+          if(stop_res == -1){
+            if(errno == EINTR){
+              continue;
             }
-            string line;
-            // ignore the first kProcStatIdx lines
-            for(unsigned int i = 0; i < kProcStatIdx; ++i){
-              getline(procfile, line, ' ');
+            if(errno == ECHILD){ // all tracees are gone
+              tracees_left = false;
+              break;
             }
-            core_iter->second.first = stoi(line);
+            cerr << "Error: unexpected return from wait - " << strerror(errno) << "\n";
+            exit(-1);
           }
+          auto thread_iter = threads.find(stop_res);
+          if(thread_iter != end(threads) && thread_iter->second.interrupted &&
+             status>>16 == PTRACE_EVENT_STOP){
+            thread_iter->second.interrupted = false;
+            thread_iter->second.stopped = true;
+            --pending;
+            continue;
+          }
+          // Something else happened first. An interrupted thread that
+          // reports another stop will still stop for our interrupt once it is
+          // resumed, unless it went away.
+          tracees_left = handle_stop(stop_res, status);
+          pending = count_if(begin(threads), end(threads),
+                             [](const pair<const int, ThreadInfo>& t) {
+                               return t.second.interrupted;
+                             });
         }
-        
-        // collect stats from cores
-        print("EAUDIT collating stats\n");
-        // read all rapl counters
-        vector<stats_t> stats(ncores);
-        for(unsigned int i = 0; i < ncores; ++i){
-          stats[i] = read_rapl(core_counters[i], period);
+        if(!tracees_left){
+          break;
         }
-        auto cur_global_stats = read_rapl(global_counters, period);
-        global_stats += cur_global_stats;
-        cout << "p: " << cur_global_stats.counters[0] << endl;
-        cout << "u: " << cur_global_stats.counters[1] << endl;
-        cout << "m: " << cur_global_stats.counters[2] << endl;
-
-        // global counter 0 is processor plane energy
-        auto proc_energies = modelPerCoreEnergies(
-          proc_model, stats, counter_names, cur_global_stats.counters[0]);
-
-        // global counter 1 is package energy, including the processor plane
-        // (which we have to remove to calcluate uncore energy
-        auto uncore_energies = modelPerCoreEnergies(
-          uncore_model, stats, counter_names, cur_global_stats.counters[1] - cur_global_stats.counters[0]);
-        // global counter 2 is DRAM energy
-        auto dram_energies = modelPerCoreEnergies(
-          dram_model, stats, counter_names, cur_global_stats.counters[2]);
 
         // read all the children registers
-        for(const auto& child : children_pids){
+        for(auto& thread : threads){
+          if(thread.second.blocked){
+            // Blocked threads were not stopped. Sample where they made
+            // their system call from.
+            thread.second.blocked = false;
+            if((unsigned)thread.second.core >= ncores) { continue; }
+            IpSample sample = IpSample();
+            sample.rip = (void*)thread.second.blocked_pc;
+            // in a shared library more often than not, so look it up like the
+            // address of a running thread
+            sample.image = sample.rip != nullptr ?
+              sample_image(thread.second.tgid, sample.rip) :
+              live_images[thread.second.tgid];
+            sample.core = thread.second.core;
+            sample.blocked = true;
+            sample.syscall = thread.second.syscall;
+            record.samples.push_back(sample);
+            continue;
+          }
+          if(!thread.second.stopped){
+            continue;
+          }
+          auto child = thread.first;
           struct user_regs_struct regs;
-          ptrace(PTRACE_GETREGS, child, nullptr, &regs);
+          if(ptrace(PTRACE_GETREGS, child, nullptr, &regs) == -1){
+            continue;
+          }
           void* rip = (void*)regs.rip;
-          auto child_core = children_cores[child].first;
-          // TODO This is a hack to avoid attempting to log threads that 
+          auto child_core = thread.second.core;
+          // TODO This is a hack to avoid attempting to log threads that
           // miraculously end up on the second hardware thread of a core.
           // We try to make sure things are bound appropriately, but there's
           // no guarantee, so we just ignore things that happen where we don't
           // want them.
           if((unsigned)child_core >= ncores) { continue; }
-          auto& profile = core_profiles[child_core][rip];
-          profile.processor_energy += proc_energies[child_core];
-          profile.uncore_energy += uncore_energies[child_core];
-          profile.dram_energy += dram_energies[child_core];
-          profile.time += stats[child_core].time;
-          profile.instructions += stats[child_core].counters[inst_counter_idx];
+          IpSample sample = IpSample();
+          sample.image = sample_image(thread.second.tgid, rip);
+          sample.core = child_core;
+          sample.rip = rip;
+          // in a system call, rip is where it returns to
+          sample.syscall = (long)regs.orig_rax;
+          record.samples.push_back(sample);
         }
-        
+
         // resume all children
-        for(const auto& child : children_pids){
-          ptrace(PTRACE_CONT, child, nullptr, nullptr);
+        for(auto& thread : threads){
+          if(thread.second.stopped){
+            ptrace(PTRACE_CONT, thread.first, nullptr, nullptr);
+            thread.second.stopped = false;
+          }
         }
+        stop_windows.record(nthreads, PAPI_get_real_nsec() - window_start);
+        refresh_images();
+        record.sample_period = period;
+        send_record();
         is_timer_done = false;
+        auto tick_end = PAPI_get_real_nsec();
+        sampling_nsecs += tick_end - tick_start;
+        window_sampling_nsecs += tick_end - tick_start;
+        if(max_overhead > 0 && samples_in_interval == 0){
+          adjust_period(tick_end);
+        }
         // resume timer
         work_time.it_value.tv_sec = sleep_secs;
         work_time.it_value.tv_usec = sleep_usecs;
         setitimer(ITIMER_REAL, &work_time, nullptr);
+      } else if(errno == ECHILD){ // all tracees are gone, with or without exits
+        break;
       } else {
         cerr << "Error: unexpected return from wait - " << strerror(errno) << "\n";
         exit(-1);
       }
-    } else { // good wait, add new thread
-      if(status>>8 == (SIGTRAP | (PTRACE_EVENT_CLONE<<8))) { // new thread created
-        print("New thread created.\n");
-        unsigned long new_pid;
-        ptrace(PTRACE_GETEVENTMSG, wait_res, nullptr, &new_pid);
-        auto pid_iter = find(begin(children_pids), end(children_pids), new_pid);
-        if(pid_iter != end(children_pids)) {
-          cerr << "Already have this newly cloned pid: " << new_pid << ".\n";
-          exit(-1);
-        }
-        print("Thread ID %lu created from thread ID %d\n", new_pid, wait_res);
-        children_pids.push_back(new_pid);
-        ptrace(PTRACE_SETOPTIONS, new_pid, nullptr,
-               PTRACE_O_EXITKILL | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXIT);
-        ptrace(PTRACE_CONT, wait_res, nullptr, nullptr);
-      } else {
-        if(status>>8 == (SIGTRAP | (PTRACE_EVENT_EXIT<<8))){
-          print("Deleting child %d\n", wait_res);
-          auto pid_iter = find(begin(children_pids), end(children_pids), wait_res);
-          if(pid_iter == end(children_pids)){
-            cerr << "Error: Saw exit from pid " << wait_res << ". We haven't seen before!\n";
-            exit(-1);
-          }
-          children_pids.erase(pid_iter);
-          if(children_pids.size() == 0){ // All done, not tracking any more threads
-            break;
-          }
-          print("%lu children left\n", children_pids.size());
-        }
-        // always let the stopped tracee continue
-        ptrace(PTRACE_CONT, wait_res, nullptr, nullptr);
-      }
+    } else if(!handle_stop(wait_res, status)) { // All done
+      break;
     }
   }
+  // hand out the energy of the last, partial interval and wait for the
+  // aggregator to catch up
+  read_core_stats();
+  read_energy();
+  record.last = true;
+  send_record();
   auto elapsed_time = PAPI_get_real_usec() - start_time;
 
   /*
-   * Done profiling. Convert data to output file.
+   * Done profiling. Convert data to output file. Most addresses have been
+   * symbolized during the run, the aggregator finishes the rest.
    */
   print("Finalize profile.\n");
   auto profile_start_time = PAPI_get_real_usec();
-  for(unsigned int i = 0; i < ncores; ++i){
-    vector<ProfileEntry> profile;
-    // Convert stack IDs into function names.
-    for (auto& core_profile : core_profiles[i]) {
-      stringstream cmd;
-      cmd << "addr2line -f -s -C -e " << profilee_name << " " << core_profile.first;
-      auto pipe = popen(cmd.str().c_str(), "r");  // call command and read output
-      if (!pipe) {
-        cerr << "Unable to open pipe to call addr2line.\n";
-        return;
-      }
-      char buffer[128];
-      string result = "";
-      while (!feof(pipe)) {
-        if (fgets(buffer, 128, pipe) != nullptr) {
-          result += buffer;
-        }
+  worker.join();
+  const auto& function_names = aggregator.function_names_;
+  vector<unordered_map<unsigned, ProfileValue>> job_profiles(ncores); // by line
+  const auto& image_profiles = aggregator.images_;
+  for(size_t image_idx = 0; image_idx < image_profiles.size(); ++image_idx){
+    const auto& image = images[image_idx];
+    const auto& core_profiles = image_profiles[image_idx].core_profiles;
+    if(all_of(begin(core_profiles), end(core_profiles),
+              [](const unordered_map<unsigned, ProfileValue>& p) { return p.empty(); })){
+      continue;
+    }
+    auto exe_base = image.exe_name.substr(image.exe_name.find_last_of('/') + 1);
+    for(unsigned int i = 0; i < ncores; ++i){
+      if(core_profiles[i].empty()){
+        continue;
       }
-      pclose(pipe);
-      stringstream resultstream{result};
-      string func_name, file_name;
-      getline(resultstream, func_name);
-      getline(resultstream, file_name);
-      // NOTE: remove the trailing function annotation that says that this 
-      // function has been used/called by different threads
-      if(func_name.back() == ']'){
-        auto last_open_bracket_pos = func_name.find_last_of('[');
-        func_name.erase(last_open_bracket_pos - 1);
-      }
-      file_name.erase(file_name.find(':'));
-      string entry_name = func_name + " at " + file_name;
-      print("Reporting function %s\n", entry_name.c_str());
-
-      auto profile_iter =
-          find_if(begin(profile), end(profile),
-                  [&](const ProfileEntry& e) { return e.name == entry_name; });
-      if(profile_iter == end(profile)){
-        ProfileEntry entry;
-        entry.name = entry_name;
-        profile.push_back(entry);
-        profile_iter = end(profile) - 1;
-      }
-      profile_iter->processor_energy += core_profile.second.processor_energy;
-      profile_iter->uncore_energy += core_profile.second.uncore_energy;
-      profile_iter->dram_energy += core_profile.second.dram_energy;
-      profile_iter->time += core_profile.second.time;
-      profile_iter->instructions += core_profile.second.instructions;
-    }
-    sort(begin(profile), end(profile),
-         [&](const ProfileEntry& a, const ProfileEntry& b) {
-           auto a_energy = a.processor_energy + a.uncore_energy + a.dram_energy;
-           auto b_energy = b.processor_energy + b.uncore_energy + b.dram_energy;
-           return a_energy > b_energy;
-         });
-
-    /*
-     * Write profile to file
-     */
+      for(const auto& line : core_profiles[i]){
+        job_profiles[i][line.first] += line.second;
+      }
+
+      /*
+       * Write per-process profile to file
+       */
+      auto profile = profile_entries(function_profile(core_profiles[i], aggregator),
+                                     function_names);
+      stringstream namestream;
+      namestream << prefix << "." << image.pid << "." << exe_base << "." << i << ".tsv";
+      write_profile(namestream.str(), profile, max_error, drop_insignificant);
+    }
+    cout << "Process " << image.pid << ":\t" << image.exe_name << "\n";
+  }
+
+  /*
+   * Write job-wide profile, merged over all processes, to file. It also gets
+   * the energy of the cores while none of our threads ran on them.
+   */
+  double attributed_energy = 0;
+  unordered_map<unsigned, ProfileValue> source_profile; // by line, all cores
+  for(unsigned int i = 0; i < ncores; ++i){
+    if(aggregator.idle_profiles_[i].time > 0){
+      job_profiles[i][aggregator.idle_line_] += aggregator.idle_profiles_[i];
+    }
+    if(aggregator.other_profiles_[i].time > 0){
+      job_profiles[i][aggregator.other_line_] += aggregator.other_profiles_[i];
+    }
+    for(const auto& line : job_profiles[i]){
+      const auto& value = line.second;
+      attributed_energy += value.processor_energy + value.uncore_energy + value.dram_energy;
+      source_profile[line.first] += value;
+    }
     stringstream namestream;
     namestream << prefix << "." << i << ".tsv";
-    ofstream outfile{namestream.str()};
-    outfile << "Name\tProcessor Energy\tUncore Energy\tDRAM Energy\tTime\tInstructions\n";
-    for(const auto& elem : profile){
-      outfile << elem.name << "\t"
-              << elem.processor_energy / kNanoToBase << "\t"
-              << elem.uncore_energy / kNanoToBase << "\t"
-              << elem.dram_energy / kNanoToBase << "\t"
-              << elem.time / kMicroToBase << "\t"
-              << elem.instructions << "\n";
+    auto profile = profile_entries(function_profile(job_profiles[i], aggregator),
+                                   function_names);
+    write_profile(namestream.str(), profile, max_error, drop_insignificant);
+
+    stringstream linesstream;
+    linesstream << prefix << "." << i << ".lines.tsv";
+    write_line_profile(linesstream.str(), job_profiles[i], aggregator);
+  }
+  write_annotated_source(string(prefix) + ".annotated.txt", source_profile, aggregator);
+
+  /*
+   * Write the time series, and a profile for each phase of the run.
+   */
+  write_series(string(prefix) + ".series.tsv", aggregator);
+  const auto& phases = aggregator.phases_;
+  for(size_t i = 0; i < phases.size(); ++i){
+    const auto& phase = phases[i];
+    if(phase.duration == 0){
+      continue;
     }
+    unordered_map<unsigned, ProfileValue> phase_profile;
+    for(const auto& function : phase.profile){
+      if(function.first >= 0){
+        phase_profile[function.first] += function.second;
+      }
+    }
+    stringstream namestream;
+    namestream << prefix << ".phase" << i << ".tsv";
+    auto profile = profile_entries(phase_profile, function_names);
+    write_profile(namestream.str(), profile, max_error, drop_insignificant);
+    cout << "Phase " << i << ":\t" << phase.start / (double)kMicroToBase << " - "
+         << (phase.start + phase.duration) / (double)kMicroToBase << " seconds\t"
+         << phase.energy / (double)kNanoToBase / (phase.duration / (double)kMicroToBase)
+         << " watts\n";
   }
 
+  const auto& global_stats = aggregator.global_stats_;
   cout << "Total Processor Energy:\t" << global_stats.counters[0] / (double)kNanoToBase << " joules\n"
        << "Total Uncore Energy:\t" << (global_stats.counters[1] - global_stats.counters[0]) / (double)kNanoToBase << " joules\n"
        << "Total DRAM Energy:\t" << global_stats.counters[2] / (double)kNanoToBase << " joules\n"
        << "Elapsed Time:\t" << elapsed_time / (double)kMicroToBase << " seconds\n";
+  // package (processor and uncore) plus DRAM
+  auto measured_energy = global_stats.counters[1] + global_stats.counters[2];
+  cout << "Attributed Energy:\t" << attributed_energy / kNanoToBase << " joules\t("
+       << (measured_energy > 0 ? 100 * attributed_energy / measured_energy : 0)
+       << "% of measured)\n";
+
+  if(event_period > 0){
+    cout << "Lost samples:\t" << lost_samples << "\n";
+  } else {
+    stop_windows.report(cout);
+    cout << "Sampling overhead:\t"
+         << (elapsed_time > 0 ? 100 * sampling_nsecs / 1e3 / elapsed_time : 0)
+         << "% of wall time\n";
+  }
+  if(max_overhead > 0){
+    // every sample weighs in with the time since the previous one, so the
+    // profile stays valid as the period changes; record the periods anyway
+    ofstream periods_file{string(prefix) + ".periods.tsv"};
+    periods_file << "Time\tSample Period\tOverhead\n";
+    long shortest = period_changes.front().period, longest = shortest;
+    for(const auto& change : period_changes){
+      periods_file << change.time / (double)kMicroToBase << "\t"
+                   << change.period << "\t"
+                   << 100 * change.overhead << "\n";
+      shortest = min(shortest, change.period);
+      longest = max(longest, change.period);
+    }
+    cout << "Sample period:\t" << shortest << " - " << longest << " usecs\t("
+         << period_changes.size() - 1 << " changes)\n";
+  }
+  cout << "Sampler waits on full queue:\t" << queue_full_waits << "\n";
+  if(max_entries > 0){
+    // how much of the profile lost its function resolution to the budget
+    double coarse_energy = 0, total_energy = 0;
+    for(const auto& image_profile : image_profiles){
+      for(const auto& profile : image_profile.core_profiles){
+        for(const auto& line : profile){
+          const auto& value = line.second;
+          auto energy = value.processor_energy + value.uncore_energy + value.dram_energy;
+          total_energy += energy;
+          if(aggregator.is_coarse(line.first)){
+            coarse_energy += energy;
+          }
+        }
+      }
+    }
+    cout << "Spilled entries:\t" << aggregator.spilled_entries_ << "\n"
+         << "Energy in coarse buckets:\t" << coarse_energy / kNanoToBase << " joules\t("
+         << (total_energy > 0 ? 100 * coarse_energy / total_energy : 0) << "%)\n";
+  }
 
   auto profile_elapsed = PAPI_get_real_usec() - profile_start_time;
   cout << "Profile creation time:\t" << profile_elapsed / (double) kMicroToBase << " seconds\n";
 }
 
 
+
 int main(int argc, char* argv[], char* envp[]) {
   /*
    * Check params
@@ -642,23 +2470,99 @@ int main(int argc, char* argv[], char* envp[]) {
     " eaudit [options] executable\n"
     "\n"
     "Options:\n"
-    " -h                  Show this help\n"
-    " -p <microseconds>   Sample period in microseconds, default 1000\n"
-    " -o <prefix>         Prefix to use when writing files, default eaudit\n"
-    " -m <filename>       Model file name, default 'default.model'\n"
+    " -h, --help                Show this help\n"
+    " -p, --period <usecs>      Sample period in microseconds, default 1000\n"
+    " -e, --energy-period <usecs>\n"
+    "                           Energy (RAPL) sample period in microseconds,\n"
+    "                           rounded to a multiple of the sample period,\n"
+    "                           default 1000\n"
+    " -i, --event-period <count>\n"
+    "                           Event-based sampling: sample each thread every\n"
+    "                           <count> events instead of every sample period\n"
+    " -s, --event <event>       Event counted for -i: instructions (default) or\n"
+    "                           cycles\n"
+    " --max-overhead <percent>  Adapt the sample period, starting at -p, so that\n"
+    "                           sampling takes at most this share of wall time\n"
+    " --min-period <usecs>      Shortest period --max-overhead picks, default 100\n"
+    " --max-period <usecs>      Longest period --max-overhead picks, default\n"
+    "                           100000\n"
+    " -b, --max-entries <entries>\n"
+    "                           Bound memory: keep at most <entries> source lines\n"
+    "                           per core and addresses per process, spilling\n"
+    "                           cold ones into per-module buckets, default\n"
+    "                           unbounded\n"
+    " -o, --output <prefix>     Prefix to use when writing files, default eaudit\n"
+    " --max-error <percent>     Flag profile entries whose 95% confidence interval\n"
+    "                           is wider than this share of their energy as not\n"
+    "                           significant, default 50\n"
+    " --drop-insignificant      Merge entries that are not significant into one\n"
+    " -m, --model <filename>    Model file name, default 'default.model'\n"
     "\n";
 
   auto period = kDefaultSamplePeriodUsecs;
+  auto energy_period = kDefaultEnergyPeriodUsecs;
+  uint64_t event_period = 0;
+  uint64_t event_config = PERF_COUNT_HW_INSTRUCTIONS;
+  size_t max_entries = 0;
   auto proc_model_fname = kDefaultModelName;
   auto uncore_model_fname = kDefaultModelName;
   auto dram_model_fname = kDefaultModelName;
   auto prefix = kDefaultPrefix;
+  double max_overhead = 0;
+  auto max_error = kDefaultMaxError;
+  bool drop_insignificant = false;
+  auto min_period = kDefaultMinPeriodUsecs;
+  auto max_period = kDefaultMaxPeriodUsecs;
+  // long options without a short one
+  enum{
+    kMaxOverheadOption = 256,
+    kMinPeriodOption,
+    kMaxPeriodOption,
+    kMaxErrorOption,
+    kDropInsignificantOption
+  };
+  const struct option long_options[] = {
+    {"help", no_argument, nullptr, 'h'},
+    {"period", required_argument, nullptr, 'p'},
+    {"energy-period", required_argument, nullptr, 'e'},
+    {"event-period", required_argument, nullptr, 'i'},
+    {"event", required_argument, nullptr, 's'},
+    {"max-entries", required_argument, nullptr, 'b'},
+    {"output", required_argument, nullptr, 'o'},
+    {"model", required_argument, nullptr, 'm'},
+    {"max-overhead", required_argument, nullptr, kMaxOverheadOption},
+    {"min-period", required_argument, nullptr, kMinPeriodOption},
+    {"max-period", required_argument, nullptr, kMaxPeriodOption},
+    {"max-error", required_argument, nullptr, kMaxErrorOption},
+    {"drop-insignificant", no_argument, nullptr, kDropInsignificantOption},
+    {nullptr, 0, nullptr, 0}
+  };
   int param;
-  while((param = getopt(argc, argv, "+hp:o:c:u:m:")) != -1){
+  while((param = getopt_long(argc, argv, "+hp:e:i:s:b:o:c:u:m:",
+                             long_options, nullptr)) != -1){
     switch(param){
       case 'p':
         period = stol(optarg);
         break;
+      case 'e':
+        energy_period = stol(optarg);
+        break;
+      case 'i':
+        event_period = stoull(optarg);
+        break;
+      case 's':
+        if(string(optarg) == "instructions"){
+          event_config = PERF_COUNT_HW_INSTRUCTIONS;
+        } else if(string(optarg) == "cycles"){
+          event_config = PERF_COUNT_HW_CPU_CYCLES;
+        } else {
+          cerr << "Error: unknown sampling event '" << optarg << "'.\n";
+          exit(-1);
+        }
+        break;
+      case 'b':
+        max_entries = stoul(optarg);
+        break;
       case 'o':
         prefix = optarg;
         break;
@@ -677,6 +2581,26 @@ int main(int argc, char* argv[], char* envp[]) {
           dram_model_fname = optarg;
         }
         break;
+      case kMaxOverheadOption:
+        // "2%" or "2"
+        max_overhead = stod(optarg) / 100;
+        if(max_overhead <= 0 || max_overhead >= 1){
+          cerr << "Error: maximum overhead has to be between 0 and 100%.\n";
+          exit(-1);
+        }
+        break;
+      case kMinPeriodOption:
+        min_period = stol(optarg);
+        break;
+      case kMaxPeriodOption:
+        max_period = stol(optarg);
+        break;
+      case kMaxErrorOption:
+        max_error = stod(optarg) / 100;
+        break;
+      case kDropInsignificantOption:
+        drop_insignificant = true;
+        break;
       case 'h':
       case '?':
         cout << usage;
@@ -689,6 +2613,18 @@ int main(int argc, char* argv[], char* envp[]) {
     }
   }
 
+  if(max_overhead > 0){
+    if(event_period > 0){
+      cerr << "Error: --max-overhead only works with period-based sampling.\n";
+      exit(-1);
+    }
+    if(min_period <= 0 || min_period > max_period){
+      cerr << "Error: bad sample period bounds.\n";
+      exit(-1);
+    }
+    period = min(max_period, max(min_period, period));
+  }
+
   /*
    * Make our models
    */
@@ -701,13 +2637,22 @@ int main(int argc, char* argv[], char* envp[]) {
    */
   auto profilee = fork();
   if(profilee > 0){ /* parent */
-    // Let's do this.
-    ptrace(PTRACE_SETOPTIONS, profilee, nullptr,
-           PTRACE_O_EXITKILL | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXIT);
-    do_profiling(profilee, argv[optind], period, prefix, proc_model, uncore_model, dram_model);
+    // Let's do this. Wait for the profilee to stop itself, then seize it so
+    // that we can interrupt its threads without sending signals.
+    int status;
+    if(waitpid(profilee, &status, WSTOPPED) == -1 || !WIFSTOPPED(status)){
+      cerr << "Error: audited program did not stop for tracing.\n";
+      return -1;
+    }
+    if(ptrace(PTRACE_SEIZE, profilee, nullptr, kTraceOptions) == -1){
+      cerr << "Error: couldn't trace audited program - " << strerror(errno) << "\n";
+      return -1;
+    }
+    do_profiling(profilee, argv[optind], period, energy_period,
+                 event_period, event_config, max_overhead, min_period,
+                 max_period, max_error, drop_insignificant, max_entries, prefix, proc_model, uncore_model, dram_model);
   } else if(profilee == 0){ /* profilee */
-    // prepare for tracing
-    ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+    // wait for the auditor to attach
     raise(SIGSTOP);
     // start up client program
     execve(argv[optind], &argv[optind], envp);
@@ -0,0 +1,384 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "symbolizer.hpp"
+
+namespace jit{
+/*
+ * Record types of the jitdump format, see tools/perf/Documentation/
+ * jitdump-specification.txt in the kernel sources.
+ */
+const uint32_t kJitdumpMagic = 0x4A695444; // "JiTD"
+const uint32_t kJitCodeLoad = 0;
+const uint32_t kJitCodeMove = 1;
+const uint32_t kJitCodeDebugInfo = 2;
+
+struct jitdump_header_t{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+};
+
+struct record_header_t{
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+};
+
+struct code_load_t{
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+  // followed by the function name and the code
+};
+
+struct code_move_t{
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t old_code_addr;
+  uint64_t new_code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+};
+
+struct debug_entry_t{
+  uint64_t addr;
+  int32_t line;
+  int32_t discrim;
+  // followed by the file name
+};
+
+/*
+ * Where in the source a piece of JIT code came from.
+ */
+struct source_line_t{
+  std::string file;
+  unsigned line;
+};
+
+/*
+ * A function the runtime compiled, and, if it said so, the source lines of
+ * its code.
+ */
+struct jit_function_t{
+  uintptr_t start;
+  uintptr_t end;
+  std::string name;
+  std::map<uintptr_t, source_line_t> lines; // first address -> line
+};
+
+/*
+ * A file a runtime keeps appending to while it runs. Only ever reads what was
+ * added since the last time, and hands out complete pieces of it.
+ */
+class GrowingFile{
+ public:
+  explicit GrowingFile(const std::string& path) : path_{path}, fd_{-1} {}
+
+  ~GrowingFile(){
+    if(fd_ != -1){
+      close(fd_);
+    }
+  }
+
+  GrowingFile(const GrowingFile&) = delete;
+  GrowingFile& operator=(const GrowingFile&) = delete;
+
+  /*
+   * Append what was written since the last call to the unconsumed data.
+   * Returns false if nothing was.
+   */
+  bool read_new(){
+    if(fd_ == -1){
+      // the runtime may only create it once it compiles something
+      fd_ = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+      if(fd_ == -1){
+        return false;
+      }
+    }
+    auto old_size = data_.size();
+    char buffer[65536];
+    ssize_t count;
+    while((count = read(fd_, buffer, sizeof(buffer))) > 0){
+      data_.append(buffer, count);
+    }
+    return data_.size() > old_size;
+  }
+
+  // data not consumed yet, possibly ending in a partly written piece
+  const std::string& data() const { return data_; }
+
+  void consume(size_t count){
+    data_.erase(0, count);
+  }
+
+ private:
+  std::string path_;
+  int fd_;
+  std::string data_;
+};
+
+/*
+ * The JIT-compiled code of one process, as the runtime describes it in
+ * /tmp/perf-<pid>.map, a jitdump file, or both. Code the runtime compiles
+ * over code it compiled before, or moves, makes the names handed out so far
+ * stale, and bumps the generation.
+ */
+class JitSymbols{
+ public:
+  // jitdump is the path of the process' jitdump file, "" to look for it in
+  // /tmp
+  JitSymbols(int pid, const std::string& jitdump)
+    : perf_map_{perf_map_path(pid)},
+      jitdump_{jitdump.empty() ? jitdump_path(pid) : jitdump},
+      jitdump_header_read_{false}, jitdump_valid_{true}, generation_{0} {}
+
+  /*
+   * Name the JIT code at an address like addr2line names native code. Looks
+   * at what the runtime has added to its files since the last miss. Returns
+   * false if the address is not known to be JIT code.
+   */
+  bool resolve(uintptr_t addr, sym::symbol_t& symbol){
+    auto function = find(addr);
+    if(!function){
+      refresh();
+      function = find(addr);
+      if(!function){
+        return false;
+      }
+    }
+    symbol.name = function->name;
+    symbol.file.clear();
+    symbol.line = 0;
+    auto line_iter = function->lines.upper_bound(addr);
+    if(line_iter != begin(function->lines)){
+      --line_iter;
+      symbol.name += " at " + line_iter->second.file.substr(
+        line_iter->second.file.find_last_of('/') + 1);
+      symbol.file = line_iter->second.file;
+      symbol.line = line_iter->second.line;
+    }
+    return true;
+  }
+
+  /*
+   * Read what the runtime added to its files since the last time.
+   */
+  void refresh(){
+    read_perf_map();
+    read_jitdump();
+  }
+
+  unsigned generation() const { return generation_; }
+
+  static std::string perf_map_path(int pid){
+    std::stringstream path;
+    path << "/tmp/perf-" << pid << ".map";
+    return path.str();
+  }
+
+  static std::string jitdump_path(int pid){
+    std::stringstream path;
+    path << "/tmp/jit-" << pid << ".dump";
+    return path.str();
+  }
+
+ private:
+  const jit_function_t* find(uintptr_t addr) const {
+    auto iter = functions_.upper_bound(addr);
+    if(iter == begin(functions_)){
+      return nullptr;
+    }
+    --iter;
+    return addr < iter->second.end ? &iter->second : nullptr;
+  }
+
+  /*
+   * Code the runtime compiled replaces whatever it compiled at the same
+   * addresses before.
+   */
+  void add_function(jit_function_t function){
+    auto iter = functions_.lower_bound(function.start);
+    if(iter != begin(functions_) && prev(iter)->second.end > function.start){
+      --iter;
+    }
+    while(iter != end(functions_) && iter->second.start < function.end){
+      iter = functions_.erase(iter);
+      ++generation_;
+    }
+    auto start = function.start;
+    functions_.emplace(start, std::move(function));
+  }
+
+  /*
+   * Lines of "START SIZE name", in hex, one per compiled function.
+   */
+  void read_perf_map(){
+    if(!perf_map_.read_new()){
+      return;
+    }
+    const auto& data = perf_map_.data();
+    size_t pos = 0, newline;
+    while((newline = data.find('\n', pos)) != std::string::npos){
+      auto line = data.substr(pos, newline - pos);
+      pos = newline + 1;
+      unsigned long start, size;
+      int name_pos = 0;
+      if(sscanf(line.c_str(), "%lx %lx %n", &start, &size, &name_pos) < 2 ||
+         name_pos == 0){
+        continue;
+      }
+      jit_function_t function;
+      function.start = start;
+      function.end = start + size;
+      function.name = line.substr(name_pos);
+      add_function(std::move(function));
+    }
+    perf_map_.consume(pos);
+  }
+
+  void read_jitdump(){
+    if(!jitdump_valid_ || !jitdump_.read_new()){
+      return;
+    }
+    const auto& data = jitdump_.data();
+    size_t pos = 0;
+    if(!jitdump_header_read_){
+      jitdump_header_t header;
+      if(data.size() < sizeof(header)){
+        return;
+      }
+      memcpy(&header, data.data(), sizeof(header));
+      if(header.magic != kJitdumpMagic || header.total_size < sizeof(header)){
+        // written by a runtime on another architecture, or not a jitdump
+        jitdump_valid_ = false;
+        return;
+      }
+      if(data.size() < header.total_size){
+        return;
+      }
+      pos = header.total_size;
+      jitdump_header_read_ = true;
+    }
+    record_header_t record;
+    while(data.size() - pos >= sizeof(record)){
+      memcpy(&record, data.data() + pos, sizeof(record));
+      if(record.total_size < sizeof(record)){
+        jitdump_valid_ = false;
+        break;
+      }
+      if(data.size() - pos < record.total_size){
+        break; // still being written
+      }
+      auto body = data.data() + pos + sizeof(record);
+      auto body_size = record.total_size - sizeof(record);
+      if(record.id == kJitCodeLoad){
+        read_code_load(body, body_size);
+      } else if(record.id == kJitCodeMove){
+        read_code_move(body, body_size);
+      } else if(record.id == kJitCodeDebugInfo){
+        read_debug_info(body, body_size);
+      }
+      pos += record.total_size;
+    }
+    jitdump_.consume(pos);
+  }
+
+  void read_code_load(const char* body, size_t size){
+    code_load_t load;
+    if(size < sizeof(load)){
+      return;
+    }
+    memcpy(&load, body, sizeof(load));
+    jit_function_t function;
+    function.start = load.code_addr;
+    function.end = load.code_addr + load.code_size;
+    function.name = std::string(body + sizeof(load),
+                                strnlen(body + sizeof(load), size - sizeof(load)));
+    // the debug info of a function comes right before it is loaded
+    auto lines_iter = pending_lines_.find(load.code_addr);
+    if(lines_iter != end(pending_lines_)){
+      function.lines = std::move(lines_iter->second);
+      pending_lines_.erase(lines_iter);
+    }
+    add_function(std::move(function));
+  }
+
+  void read_code_move(const char* body, size_t size){
+    code_move_t move;
+    if(size < sizeof(move)){
+      return;
+    }
+    memcpy(&move, body, sizeof(move));
+    auto iter = functions_.find(move.old_code_addr);
+    if(iter == end(functions_)){
+      return;
+    }
+    auto function = std::move(iter->second);
+    functions_.erase(iter);
+    ++generation_;
+    std::map<uintptr_t, source_line_t> lines;
+    for(auto& line : function.lines){
+      lines.emplace(line.first - move.old_code_addr + move.new_code_addr,
+                    std::move(line.second));
+    }
+    function.lines = std::move(lines);
+    function.start = move.new_code_addr;
+    function.end = move.new_code_addr + move.code_size;
+    add_function(std::move(function));
+  }
+
+  void read_debug_info(const char* body, size_t size){
+    uint64_t code_addr, count;
+    if(size < 2 * sizeof(uint64_t)){
+      return;
+    }
+    memcpy(&code_addr, body, sizeof(code_addr));
+    memcpy(&count, body + sizeof(code_addr), sizeof(count));
+    auto& lines = pending_lines_[code_addr];
+    size_t pos = 2 * sizeof(uint64_t);
+    for(uint64_t i = 0; i < count && size - pos > sizeof(debug_entry_t); ++i){
+      debug_entry_t entry;
+      memcpy(&entry, body + pos, sizeof(entry));
+      pos += sizeof(entry);
+      auto file_size = strnlen(body + pos, size - pos);
+      source_line_t line;
+      line.file = std::string(body + pos, file_size);
+      line.line = entry.line > 0 ? entry.line : 0;
+      lines[entry.addr] = line;
+      pos += file_size + 1;
+      if(pos > size){
+        break;
+      }
+    }
+  }
+
+  GrowingFile perf_map_;
+  GrowingFile jitdump_;
+  bool jitdump_header_read_;
+  bool jitdump_valid_;
+  unsigned generation_; // of code replaced or moved
+  std::map<uintptr_t, jit_function_t> functions_; // by start address
+  std::map<uintptr_t, std::map<uintptr_t, source_line_t>> pending_lines_;
+};
+
+}
@@ -0,0 +1,143 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace perf{
+/*
+ * Size of each sampling ring buffer, in pages, not counting the header page.
+ * Must be a power of two.
+ */
+const size_t kRingPages = 64;
+
+/*
+ * A per-thread counter that writes a sample into its ring buffer every
+ * `period` events.
+ */
+struct sampler_t{
+  int fd;
+  perf_event_mmap_page* header;
+  char* data;
+  size_t data_size;
+  sampler_t() : fd{-1}, header{nullptr}, data{nullptr}, data_size{0} {}
+};
+
+/*
+ * One PERF_RECORD_SAMPLE, in the layout requested by open_sampler().
+ */
+struct sample_t{
+  uint64_t ip;
+  uint32_t pid, tid;
+  uint64_t time;
+  uint32_t cpu, reserved;
+  uint64_t period;
+  uint64_t value;        // PERF_SAMPLE_READ with PERF_FORMAT_TOTAL_TIME_RUNNING
+  uint64_t time_running; // nanoseconds the thread has been on a CPU
+};
+
+/*
+ * Start sampling the given thread every `period` occurrences of the hardware
+ * event `config` (e.g. PERF_COUNT_HW_INSTRUCTIONS), counting user mode only.
+ * Returns a sampler with fd -1 if the thread is already gone, and exits on any
+ * other error.
+ */
+inline sampler_t open_sampler(int tid, uint64_t config, uint64_t period){
+  sampler_t result;
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.sample_period = period;
+  attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+                     PERF_SAMPLE_CPU | PERF_SAMPLE_PERIOD | PERF_SAMPLE_READ;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  result.fd = syscall(__NR_perf_event_open, &attr, tid, -1, -1,
+                      PERF_FLAG_FD_CLOEXEC);
+  if(result.fd == -1){
+    if(errno == ESRCH){
+      return result;
+    }
+    std::cerr << "Error: unable to open sampling counter for thread " << tid
+              << " - " << strerror(errno) << "\n";
+    exit(-1);
+  }
+  auto page_size = sysconf(_SC_PAGESIZE);
+  auto ring = mmap(nullptr, (kRingPages + 1) * page_size,
+                   PROT_READ | PROT_WRITE, MAP_SHARED, result.fd, 0);
+  if(ring == MAP_FAILED){
+    std::cerr << "Error: unable to map sampling buffer for thread " << tid
+              << " - " << strerror(errno) << "\n";
+    exit(-1);
+  }
+  result.header = static_cast<perf_event_mmap_page*>(ring);
+  result.data = static_cast<char*>(ring) + page_size;
+  result.data_size = kRingPages * page_size;
+  return result;
+}
+
+inline void close_sampler(sampler_t& sampler){
+  if(sampler.fd == -1){
+    return;
+  }
+  munmap(sampler.header, sampler.data_size + sysconf(_SC_PAGESIZE));
+  close(sampler.fd);
+  sampler = sampler_t();
+}
+
+/*
+ * Hand every sample written since the last call to callback, and free up
+ * their space in the ring. Returns the number of samples the kernel had to
+ * drop because the ring was full.
+ */
+template<typename F>
+uint64_t drain_samples(sampler_t& sampler, F callback){
+  uint64_t lost = 0;
+  if(sampler.fd == -1){
+    return lost;
+  }
+  auto head = __atomic_load_n(&sampler.header->data_head, __ATOMIC_ACQUIRE);
+  auto tail = sampler.header->data_tail;
+  char record[256];
+  while(tail < head){
+    // records may wrap around the end of the ring, so copy them out first
+    auto offset = tail % sampler.data_size;
+    perf_event_header event;
+    auto copy_out = [&](void* dest, size_t size){
+      auto first = std::min<size_t>(size, sampler.data_size - offset);
+      memcpy(dest, sampler.data + offset, first);
+      memcpy(static_cast<char*>(dest) + first, sampler.data, size - first);
+    };
+    copy_out(&event, sizeof(event));
+    if(event.size < sizeof(event)){
+      break;
+    }
+    if(event.size > sizeof(record)){ // not a record type we asked for
+      tail += event.size;
+      continue;
+    }
+    copy_out(record, event.size);
+    if(event.type == PERF_RECORD_SAMPLE){
+      sample_t sample;
+      memcpy(&sample, record + sizeof(event), sizeof(sample));
+      callback(sample);
+    } else if(event.type == PERF_RECORD_LOST){
+      uint64_t lost_record[2]; // id, lost
+      memcpy(lost_record, record + sizeof(event), sizeof(lost_record));
+      lost += lost_record[1];
+    }
+    tail += event.size;
+  }
+  __atomic_store_n(&sampler.header->data_tail, tail, __ATOMIC_RELEASE);
+  return lost;
+}
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <algorithm>
+
+namespace phase{
+/*
+ * Online change-point detection on a series of power readings: a two-sided
+ * CUSUM on the deviation of every reading from the mean of the current phase,
+ * relative to that mean. Deviations within the drift are taken as noise; a
+ * phase ends once the deviations beyond it add up to the threshold, e.g. with
+ * a drift of 0.1 and a threshold of 1, after 5 readings 30% off the mean, or
+ * 2 readings twice the mean.
+ */
+class ChangeDetector{
+ public:
+  // a phase is at least min_length readings long
+  ChangeDetector(double drift, double threshold, unsigned min_length)
+    : drift_{drift}, threshold_{threshold}, min_length_{min_length} {
+    reset();
+  }
+
+  /*
+   * Add the next reading. Returns true if it starts a new phase.
+   */
+  bool add(double power){
+    if(length_ >= min_length_){
+      auto deviation = mean_ > 0 ? power / mean_ - 1 : (power > 0 ? 1 : 0);
+      up_ = std::max(0.0, up_ + deviation - drift_);
+      down_ = std::max(0.0, down_ - deviation - drift_);
+      if(up_ > threshold_ || down_ > threshold_){
+        reset();
+        add_to_mean(power);
+        return true;
+      }
+    }
+    add_to_mean(power);
+    return false;
+  }
+
+ private:
+  void reset(){
+    length_ = 0;
+    mean_ = 0;
+    up_ = 0;
+    down_ = 0;
+  }
+
+  void add_to_mean(double power){
+    ++length_;
+    mean_ += (power - mean_) / length_;
+  }
+
+  double drift_;
+  double threshold_;
+  unsigned min_length_;
+  unsigned length_; // readings in the current phase
+  double mean_;
+  double up_, down_; // cumulative deviations above and below the mean
+};
+
+}
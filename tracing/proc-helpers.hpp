@@ -0,0 +1,300 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <limits.h>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include <elf.h>
+
+namespace proc{
+/*
+ * One executable region of a traced process' address space, as listed in
+ * /proc/<pid>/maps.
+ */
+struct mapping_t{
+  uintptr_t start;
+  uintptr_t end;
+  uintptr_t offset;
+  std::string path;
+  // true for shared objects and PIE executables, whose addresses have to be
+  // made relative to the load address before handing them to addr2line
+  bool relocatable;
+  // p_vaddr - p_offset of the ELF segment this mapping was loaded from
+  intptr_t vaddr_delta;
+};
+
+inline bool operator<(const mapping_t& a, const mapping_t& b){
+  return a.start < b.start;
+}
+
+/*
+ * Inspect the ELF file backing a mapping: whether it is relocatable and how
+ * file offsets in the mapped segment translate to link-time addresses.
+ */
+inline void read_elf_info(mapping_t& mapping){
+  mapping.relocatable = false;
+  mapping.vaddr_delta = 0;
+  std::ifstream in{mapping.path, std::ios::binary};
+  if(!in.is_open()){
+    return;
+  }
+  Elf64_Ehdr header;
+  if(!in.read(reinterpret_cast<char*>(&header), sizeof(header))){
+    return;
+  }
+  if(memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 ||
+     header.e_ident[EI_CLASS] != ELFCLASS64){
+    return;
+  }
+  mapping.relocatable = header.e_type == ET_DYN;
+  in.seekg(header.e_phoff);
+  for(unsigned i = 0; i < header.e_phnum; ++i){
+    Elf64_Phdr phdr;
+    if(!in.read(reinterpret_cast<char*>(&phdr), sizeof(phdr))){
+      return;
+    }
+    if(phdr.p_type == PT_LOAD && mapping.offset >= phdr.p_offset &&
+       mapping.offset < phdr.p_offset + phdr.p_filesz){
+      mapping.vaddr_delta = phdr.p_vaddr - phdr.p_offset;
+      return;
+    }
+  }
+}
+
+/*
+ * Read all executable, file-backed mappings of the given process, sorted by
+ * start address, and if asked for, the executable anonymous ones (JIT code,
+ * the vdso), which have no path. The ELF files backing the mappings are left
+ * to merge_mappings() to inspect.
+ */
+inline std::vector<mapping_t> read_mappings(int pid,
+                                            std::vector<mapping_t>* anonymous = nullptr){
+  std::vector<mapping_t> result;
+  std::stringstream fname;
+  fname << "/proc/" << pid << "/maps";
+  std::ifstream in{fname.str()};
+  if(!in.is_open()){
+    return result;
+  }
+  std::string line;
+  while(getline(in, line)){
+    unsigned long start, end, offset;
+    char perms[5];
+    int path_pos = 0;
+    if(sscanf(line.c_str(), "%lx-%lx %4s %lx %*x:%*x %*u %n",
+              &start, &end, perms, &offset, &path_pos) < 4){
+      continue;
+    }
+    if(perms[2] != 'x'){
+      continue;
+    }
+    mapping_t mapping;
+    mapping.start = start;
+    mapping.end = end;
+    mapping.offset = offset;
+    mapping.relocatable = false;
+    mapping.vaddr_delta = 0;
+    if(path_pos == 0 || line[path_pos] != '/'){
+      if(anonymous != nullptr){
+        anonymous->push_back(mapping);
+      }
+      continue;
+    }
+    mapping.path = line.substr(path_pos);
+    result.push_back(mapping);
+  }
+  sort(begin(result), end(result));
+  if(anonymous != nullptr){
+    sort(begin(*anonymous), end(*anonymous));
+  }
+  return result;
+}
+
+/*
+ * Merge freshly read mappings into the ones we already know about, reading
+ * the ELF info of the new ones. Mappings that have since been unmapped are
+ * kept so that addresses sampled while they were live can still be resolved.
+ * Returns true if there were new ones.
+ */
+inline bool merge_mappings(std::vector<mapping_t>& known,
+                           const std::vector<mapping_t>& fresh){
+  bool changed = false;
+  for(const auto& mapping : fresh){
+    auto iter = find_if(begin(known), end(known), [&](const mapping_t& m) {
+      return m.start == mapping.start && m.end == mapping.end &&
+             m.path == mapping.path;
+    });
+    if(iter == end(known)){
+      known.push_back(mapping);
+      read_elf_info(known.back());
+      changed = true;
+    }
+  }
+  if(changed){
+    sort(begin(known), end(known));
+  }
+  return changed;
+}
+
+inline const mapping_t* find_mapping(const std::vector<mapping_t>& mappings,
+                                     uintptr_t addr){
+  auto iter = upper_bound(begin(mappings), end(mappings), addr,
+                          [](uintptr_t a, const mapping_t& m) {
+                            return a < m.start;
+                          });
+  if(iter == begin(mappings)){
+    return nullptr;
+  }
+  --iter;
+  // Later mappings may overlap earlier, stale ones; walk back to find any
+  // that covers the address.
+  for(;; --iter){
+    if(addr >= iter->start && addr < iter->end){
+      return &*iter;
+    }
+    if(iter == begin(mappings)){
+      return nullptr;
+    }
+  }
+}
+
+/*
+ * Translate a runtime address into the address addr2line expects for the
+ * module backing it.
+ */
+inline uintptr_t module_address(const mapping_t& mapping, uintptr_t addr){
+  if(mapping.relocatable){
+    return addr - mapping.start + mapping.offset + mapping.vaddr_delta;
+  }
+  return addr;
+}
+
+inline std::string read_exe(int pid){
+  std::stringstream fname;
+  fname << "/proc/" << pid << "/exe";
+  char buffer[PATH_MAX];
+  auto len = readlink(fname.str().c_str(), buffer, sizeof(buffer) - 1);
+  if(len < 0){
+    return "";
+  }
+  buffer[len] = '\0';
+  return buffer;
+}
+
+/*
+ * Returns the thread group (process) ID that the given thread belongs to, or
+ * -1 if the thread no longer exists.
+ */
+inline int read_tgid(int tid){
+  std::stringstream fname;
+  fname << "/proc/" << tid << "/status";
+  std::ifstream in{fname.str()};
+  std::string line;
+  while(getline(in, line)){
+    if(line.compare(0, 5, "Tgid:") == 0){
+      return std::stoi(line.substr(5));
+    }
+  }
+  return -1;
+}
+
+/*
+ * Fields of /proc/<pid>/task/<tid>/stat: the thread's state (R, S, D, ...) and
+ * the CPU it last ran on.
+ */
+const unsigned kStatStateField = 3;
+const unsigned kStatProcessorField = 39;
+
+struct task_state_t{
+  char state;
+  int cpu;
+};
+
+/*
+ * Open one of a thread's /proc files (e.g. "stat"), to be read again at every
+ * sample. Returns -1 if the thread is gone (or we are out of descriptors).
+ */
+inline int open_task_file(int tgid, int tid, const char* file){
+  char fname[64];
+  snprintf(fname, sizeof(fname), "/proc/%d/task/%d/%s", tgid, tid, file);
+  return open(fname, O_RDONLY | O_CLOEXEC);
+}
+
+/*
+ * Read the state of a thread and the CPU it last ran on from its open stat
+ * file. This runs for every thread at every sample, so it avoids streams and
+ * allocations: one pread and a scan for the fields. Returns false on failure.
+ */
+inline bool read_task_state(int stat_fd, task_state_t& result){
+  char buffer[1024];
+  auto len = pread(stat_fd, buffer, sizeof(buffer) - 1, 0);
+  if(len <= 0){
+    return false;
+  }
+  buffer[len] = '\0';
+  // The command name (field 2) may contain spaces and parentheses, so start
+  // counting after the last ')', which ends field 2.
+  const char* p = static_cast<const char*>(memrchr(buffer, ')', len));
+  if(!p){
+    return false;
+  }
+  unsigned field = 2;
+  for(++p; *p != '\0' && field < kStatProcessorField; ++p){
+    if(*p == ' '){
+      ++field;
+      if(field == kStatStateField){
+        result.state = p[1];
+      }
+    }
+  }
+  if(field != kStatProcessorField || *p < '0' || *p > '9'){
+    return false;
+  }
+  result.cpu = 0;
+  for(; *p >= '0' && *p <= '9'; ++p){
+    result.cpu = result.cpu * 10 + (*p - '0');
+  }
+  return true;
+}
+
+/*
+ * Read the system call a blocked thread is in, and the user space address it
+ * was made from, from its open syscall file. nr is -1 if the thread is blocked
+ * outside of a system call (e.g. in a page fault). Returns false if the thread
+ * is running, or on failure.
+ */
+inline bool read_task_syscall(int syscall_fd, long& nr, uintptr_t& pc){
+  char buffer[256];
+  auto len = pread(syscall_fd, buffer, sizeof(buffer) - 1, 0);
+  if(len <= 0){
+    return false;
+  }
+  buffer[len] = '\0';
+  // "<nr> <6 args> <sp> <pc>", "-1 <sp> <pc>" or "running"
+  char* p = buffer;
+  char* next;
+  nr = strtol(p, &next, 10);
+  if(next == p){
+    return false;
+  }
+  unsigned long last = 0;
+  for(p = next; ; p = next){
+    auto value = strtoul(p, &next, 16);
+    if(next == p){
+      break;
+    }
+    last = value;
+  }
+  pc = last;
+  return true;
+}
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/*
+ * Bounded, lock-free queue between exactly one producer thread and one
+ * consumer thread. Neither side ever blocks the other: push() fails when the
+ * queue is full and pop() fails when it is empty, and the caller decides how
+ * to wait.
+ */
+template<typename T>
+class SpscQueue{
+ public:
+  // capacity is rounded up to a power of two
+  explicit SpscQueue(size_t capacity) : head_{0}, tail_{0} {
+    size_t size = 1;
+    while(size < capacity){
+      size <<= 1;
+    }
+    slots_.resize(size);
+    mask_ = size - 1;
+  }
+
+  // Only called by the producer. Moves item into the queue if there is room.
+  bool push(T& item){
+    auto tail = tail_.load(std::memory_order_relaxed);
+    if(tail - head_.load(std::memory_order_acquire) == slots_.size()){
+      return false;
+    }
+    slots_[tail & mask_] = std::move(item);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Only called by the consumer. Moves the oldest item out of the queue.
+  bool pop(T& item){
+    auto head = head_.load(std::memory_order_relaxed);
+    if(head == tail_.load(std::memory_order_acquire)){
+      return false;
+    }
+    item = std::move(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  std::vector<T> slots_;
+  size_t mask_;
+  // consumer and producer positions on separate cache lines
+  alignas(64) std::atomic<size_t> head_;
+  alignas(64) std::atomic<size_t> tail_;
+};
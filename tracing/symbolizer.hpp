@@ -0,0 +1,189 @@
+#pragma once
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <spawn.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+extern char** environ;
+
+namespace sym{
+/*
+ * One frame of addr2line output: a function and where in the source it is.
+ * Inlined code has several frames per address.
+ */
+struct frame_t{
+  std::string function;
+  std::string file; // full path, "" if unknown
+  unsigned line;    // 0 if unknown
+};
+
+/*
+ * What an address resolves to: the name of its profile entry, "function at
+ * file", and the source line of the innermost frame.
+ */
+struct symbol_t{
+  std::string name;
+  std::string file;
+  unsigned line;
+};
+
+/*
+ * Parse the two lines addr2line -f prints per frame.
+ */
+inline frame_t parse_frame(std::string func_name, const std::string& file_line){
+  // NOTE: remove the trailing function annotation that says that this
+  // function has been used/called by different threads
+  if(!func_name.empty() && func_name.back() == ']'){
+    auto last_open_bracket_pos = func_name.find_last_of('[');
+    func_name.erase(last_open_bracket_pos - 1);
+  }
+  frame_t frame;
+  frame.function = func_name == "??" ? "" : func_name;
+  frame.line = 0;
+  // "file:line", possibly followed by " (discriminator n)"
+  auto location = file_line.substr(0, file_line.find(" ("));
+  auto colon_pos = location.find_last_of(':');
+  frame.file = location.substr(0, colon_pos);
+  if(frame.file == "??"){
+    frame.file.clear();
+  }
+  if(colon_pos != std::string::npos){
+    frame.line = strtoul(location.c_str() + colon_pos + 1, nullptr, 10);
+  }
+  return frame;
+}
+
+/*
+ * Turn the frames addr2line printed for an address, innermost first, into a
+ * symbol. Code inlined into another function is named after both, so that it
+ * doesn't disappear into the function it was inlined into. Code addr2line
+ * knows nothing about is kept apart per module rather than lumped together.
+ */
+inline symbol_t make_symbol(const std::string& module,
+                            const std::vector<frame_t>& frames){
+  symbol_t symbol;
+  symbol.line = 0;
+  if(frames.empty() || frames.front().function.empty()){
+    symbol.name = "?? in " + module.substr(module.find_last_of('/') + 1);
+    return symbol;
+  }
+  const auto& inner = frames.front();
+  symbol.name = inner.function;
+  if(!inner.file.empty()){
+    symbol.name += " at " + inner.file.substr(inner.file.find_last_of('/') + 1);
+  }
+  if(frames.size() > 1 && !frames.back().function.empty()){
+    symbol.name += " inlined into " + frames.back().function;
+  }
+  symbol.file = inner.file;
+  symbol.line = inner.line;
+  return symbol;
+}
+
+/*
+ * A long-running addr2line for one module, fed one address at a time, so
+ * that the module's debug info is only loaded once.
+ */
+class Addr2line{
+ public:
+  explicit Addr2line(const std::string& module)
+    : module_{module}, pid_{-1}, to_{nullptr}, from_{nullptr} {
+    int to_pipe[2], from_pipe[2];
+    if(pipe2(to_pipe, O_CLOEXEC) == -1 || pipe2(from_pipe, O_CLOEXEC) == -1){
+      std::cerr << "Unable to open pipe to call addr2line.\n";
+      exit(-1);
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, to_pipe[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, from_pipe[1], STDOUT_FILENO);
+    // -a echoes every address before its frames, which tells us where the
+    // (inlined) frames of one address end
+    const char* argv[] = {"addr2line", "-a", "-i", "-f", "-C", "-e",
+                          module_.c_str(), nullptr};
+    if(posix_spawnp(&pid_, "addr2line", &actions, nullptr,
+                    const_cast<char**>(argv), environ) != 0){
+      std::cerr << "Unable to start addr2line.\n";
+      exit(-1);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    close(to_pipe[0]);
+    close(from_pipe[1]);
+    to_ = fdopen(to_pipe[1], "w");
+    from_ = fdopen(from_pipe[0], "r");
+  }
+
+  ~Addr2line(){
+    fclose(to_);
+    fclose(from_);
+    waitpid(pid_, nullptr, 0);
+  }
+
+  Addr2line(const Addr2line&) = delete;
+  Addr2line& operator=(const Addr2line&) = delete;
+
+  /*
+   * Resolve an address inside of the module. If addr2line is gone (e.g. the
+   * module no longer exists), the address is reported as unknown code of the
+   * module.
+   */
+  symbol_t resolve(uintptr_t addr){
+    std::vector<frame_t> frames;
+    // Follow the address with 0, whose echo marks the end of its frames.
+    if(fprintf(to_, "%#lx\n0\n", (unsigned long)addr) < 0 || fflush(to_) != 0){
+      return make_symbol(module_, frames);
+    }
+    std::string echo, func_name, file_line;
+    if(!read_line(echo)){
+      return make_symbol(module_, frames);
+    }
+    for(;;){
+      if(!read_line(func_name)){
+        return make_symbol(module_, frames);
+      }
+      if(func_name == kEndMarker){
+        break;
+      }
+      if(!read_line(file_line)){
+        return make_symbol(module_, frames);
+      }
+      frames.push_back(parse_frame(func_name, file_line));
+    }
+    // the frame of address 0
+    read_line(func_name);
+    read_line(file_line);
+    return make_symbol(module_, frames);
+  }
+
+ private:
+  bool read_line(std::string& line){
+    char buffer[256];
+    line.clear();
+    while(fgets(buffer, sizeof(buffer), from_) != nullptr){
+      line += buffer;
+      if(line.back() == '\n'){
+        line.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // how addr2line -a echoes address 0
+  const char* const kEndMarker = "0x0000000000000000";
+
+  std::string module_;
+  pid_t pid_;
+  FILE* to_;
+  FILE* from_;
+};
+
+}
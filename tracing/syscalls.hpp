@@ -0,0 +1,42 @@
+#pragma once
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace sys{
+struct syscall_name_t{
+  long nr;
+  const char* name;
+};
+
+/*
+ * x86_64 system call names, generated from the kernel headers by the Makefile
+ * (see syscall-names.inc).
+ */
+const syscall_name_t kSyscallNames[] = {
+#include "syscall-names.inc"
+};
+
+/*
+ * Name of an x86_64 system call, e.g. "read" for 0, or "syscall <nr>" for
+ * numbers the headers we were built with don't know.
+ */
+inline std::string syscall_name(long nr){
+  static std::vector<const char*> names;
+  if(names.empty()){
+    for(const auto& syscall : kSyscallNames){
+      if(syscall.nr >= (long)names.size()){
+        names.resize(syscall.nr + 1, nullptr);
+      }
+      names[syscall.nr] = syscall.name;
+    }
+  }
+  if(nr >= 0 && nr < (long)names.size() && names[nr]){
+    return names[nr];
+  }
+  std::stringstream name;
+  name << "syscall " << nr;
+  return name.str();
+}
+
+}